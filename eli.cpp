@@ -1,14 +1,44 @@
 #include <sstream>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <new>
+#include <bitset>
+#include <thread>
+#include <array>
+#include <deque>
+#include <functional>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
 #include "eli.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+// the kernels have SSE2 and AVX2 versions, AVX2 is picked at run time if the processor has it
+#define ELI_X86_KERNELS
+#define ELI_AVX2 __attribute__((target("avx2")))
+#endif
+
 #define VALUES(x) x->list()->values
 #define VAL_SIZE VALUES(tree).size()
 #define CHECK_ARG_COUNT(c) if (VAL_SIZE < c) throw Insufficient_arguments{tree}
-#define BUILTIN_SIGNATURE [](NodePtr tree, SymbolTable sym, ELI* eli)
-#define EVAL_ARG(idx) eli->eval(VALUES(tree)[idx], sym)
+#define BUILTIN_SIGNATURE [](const NodePtr& tree, const Env& sym, ELI* eli)
+// the arguments of a builtin called by an Applier are values already, they are not evaluated again
+#define EVAL_ARG(idx) (tree.get() == evaluated_call ? VALUES(tree)[idx] : eli->eval(VALUES(tree)[idx], sym))
+// the sequence argument of a function that pulls its elements one at a time (see eval_lazy)
+#define EVAL_SEQUENCE_ARG(idx) (tree.get() == evaluated_call ? VALUES(tree)[idx] : eval_lazy(eli, VALUES(tree)[idx], sym))
 #define ENSURE_ATOM(x) if (!x->is_atom()) throw Invalid_argument{x}
-#define ENSURE_LIST(x) if (!x->is_list()) throw Invalid_argument{x}
+// a list, a vector or a lazy sequence
+#define ENSURE_SEQUENCE(x) if (!x->is_list()) throw Invalid_argument{x}
+// a list or a vector, a lazy sequence is forced
+#define ENSURE_STRICT(x) ENSURE_SEQUENCE(x); if (auto s = x->seq()) x = s->force()
+// a list argument, a packed vector is unpacked into a list of atoms
+#define ENSURE_LIST(x) ENSURE_STRICT(x); if (x->vector()) x = unpack(eli, x)
 #define ENSURE_FUNC(x) if (!x->is_func()) throw Invalid_argument{x}
+#define ENSURE_DICT(x) if (!x->dict()) throw Invalid_argument{x}
 #define ENSURE_NOT_EMPTY(x) if (x->is_empty()) throw Invalid_argument{x}
 
 namespace maxy
@@ -43,6 +73,20 @@ namespace maxy
 				std::string func;
 				Function_not_found(std::string s) : func{ s } {};
 			};
+			struct ELI::Recursion_too_deep
+			{
+				std::string message;
+				Recursion_too_deep(std::string s) : message{ s } {}
+			};
+			struct ELI::Symbol_table_full
+			{
+				std::string name;
+			};
+			// thrown to the host (a registry or setting changed while contexts read the interpreter)
+			struct ELI::Image_in_use : std::logic_error
+			{
+				Image_in_use(const char* what) : std::logic_error{ std::string("Cannot ") + what + " while contexts use the interpreter" } {}
+			};
 
 			std::string ELI::Node::to_string(void)
 			{
@@ -51,115 +95,258 @@ namespace maxy
 				return os.str();
 			}
 
-			bool ELI::Node::compare(ELI::NodePtr other)
-			{
-				if (type() != other->type()) return false;
-
-				switch (type())
-				{
-				case Type::Atom:
-					return atom()->value == other->atom()->value;
+			// Every whole number up to 2^53 is exact in a double
+			static const long long max_exact_integer = 1LL << 53;
 
-				case Type::Func:
-					return false; // todo: compare functions
+			static bool exact_in_double(long long i)
+			{
+				return i >= -max_exact_integer && i <= max_exact_integer;
+			}
 
-				case Type::List:
-					if (list()->values.size() != other->list()->values.size()) return false;
+			// The double is a whole number that converts to a long long without loss
+			static bool whole_number(double d)
+			{
+				return d >= -(double)max_exact_integer && d <= (double)max_exact_integer && d == std::trunc(d);
+			}
 
-					for (size_t i = 0; i < list()->values.size(); i++)
-						if (!list()->values[i]->compare(other->list()->values[i]))
-							return false;
-				}
+			// Exact arithmetic on whole numbers, false when the result does not fit (the caller falls back to doubles)
+			static bool add_integers(long long a, long long b, long long& r)
+			{
+				if (b > 0 ? a > LLONG_MAX - b : a < LLONG_MIN - b) return false;
+				r = a + b;
 				return true;
 			}
 
-			ELI::Atom* ELI::Node::atom() { return dynamic_cast<Atom*>(this); }
-			ELI::List* ELI::Node::list() { return dynamic_cast<List*>(this); }
-			ELI::Func* ELI::Node::func() { return dynamic_cast<Func*>(this); }
-			ELI::Builtin* ELI::Node::builtin() { return dynamic_cast<Builtin*>(this); }
-
-			void ELI::Atom::output(std::ostream& os)
+			static bool sub_integers(long long a, long long b, long long& r)
 			{
-				os << value;
+				if (b < 0 ? a > LLONG_MAX + b : a < LLONG_MIN + b) return false;
+				r = a - b;
+				return true;
 			}
 
-			ELI::Atom::operator bool()
+			static bool mul_integers(long long a, long long b, long long& r)
 			{
-				auto d = std::atof(value.c_str());
-				return d != 0.0l || value == "true";
+				if (a > 0 ? (b > 0 ? a > LLONG_MAX / b : b < LLONG_MIN / a) : (b > 0 ? a < LLONG_MIN / b : a != 0 && b < LLONG_MAX / a)) return false;
+				r = a * b;
+				return true;
 			}
 
-			ELI::Atom::operator double()
+			// only a quotient without remainder stays whole
+			static bool div_integers(long long a, long long b, long long& r)
 			{
-				return std::atof(value.c_str());
+				if (b == 0 || (a == LLONG_MIN && b == -1) || a % b != 0) return false;
+				r = a / b;
+				return true;
 			}
 
-			void ELI::List::output(std::ostream& os)
+			static bool mod_integers(long long a, long long b, long long& r)
 			{
-				os << '(';
+				if (b == 0) return false;
+				r = b == -1 ? 0 : a % b;
+				return true;
+			}
 
-				for (size_t i = 0; i < values.size(); i++)
-				{
-					values[i]->output(os);
+			static bool less_integers(long long a, long long b, long long& r) { r = a < b; return true; }
+			static bool greater_integers(long long a, long long b, long long& r) { r = a > b; return true; }
+			static bool less_equal_integers(long long a, long long b, long long& r) { r = a <= b; return true; }
+			static bool greater_equal_integers(long long a, long long b, long long& r) { r = a >= b; return true; }
+			static bool equal_integers(long long a, long long b, long long& r) { r = a == b; return true; }
+			static bool not_equal_integers(long long a, long long b, long long& r) { r = a != b; return true; }
 
-					if (i < values.size() - 1) os << ' ';
-				}
+			// Both nodes are atoms holding whole numbers
+			static bool integers(const ELI::NodePtr& a, const ELI::NodePtr& b, long long& x, long long& y)
+			{
+				auto p = a->atom(), q = b->atom();
+				if (!p || !q || !p->integral || !q->integral) return false;
 
-				os << ')';
+				x = p->integer;
+				y = q->integer;
+				return true;
 			}
 
-			ELI::List::operator bool()
+			// The text is the way a whole number prints (no sign but `-`, no leading zeroes)
+			static bool integer_text(const std::string& s)
 			{
-				return values.size() > 0;
+				size_t i = !s.empty() && s[0] == '-';
+				if (i == s.size() || (s[i] == '0' && (i || s.size() > 1))) return false;
+
+				for (; i < s.size(); i++)
+					if (s[i] < '0' || s[i] > '9') return false;
+
+				return true;
 			}
 
-			// CALL Lisp function
-			ELI::NodePtr ELI::Func::call(ELI::NodePtr tree, ELI::SymbolTable sym, ELI *eli)
+			// Compare numbers the way `compare` compares computed atoms (`b_atom` is the atom holding `b`, if any)
+			static bool numbers_equal(double a, double b, ELI::Atom* b_atom = nullptr)
 			{
-				auto head = VALUES(tree)[0];
-				auto count = head->func()->parameter_names.size();
+				// a whole number past 2^53 equals only the double that converts back to it
+				if (b_atom && b_atom->integral && !exact_in_double(b_atom->integer))
+					return a >= (double)LLONG_MIN && a < -(double)LLONG_MIN && (long long)a == b_atom->integer;
 
-				if (VAL_SIZE < count + 1) throw Insufficient_arguments{ tree };
+				// 0 and -0 print differently
+				if (a == b) return std::signbit(a) == std::signbit(b);
 
-				std::vector<NodePtr> params;
-				for (size_t i = 0; i < count; i++)
+				// numbers that differ by more than the printed precision never print equal;
+				// the rest (including nan) are compared by their text
+				if (std::fabs(a - b) > 1e-15) return false;
+
+				return ELI::Atom::number_to_string(a) == (b_atom ? b_atom->to_string() : ELI::Atom::number_to_string(b));
+			}
+
+			bool ELI::Node::compare(ELI::NodePtr other)
+			{
+				if (type() != other->type()) return false;
+
+				switch (type())
+				{
+				case Type::Atom:
 				{
-					params.push_back(eli->eval(VALUES(tree)[1 + i], sym));
+					auto a = atom(), b = other->atom();
+
+					// atoms are equal when their text is (`1` and `1.0` differ, `nan` equals `nan`),
+					// the text of computed numbers is only made when their numbers are too close to tell
+					if (a->textual && b->textual) return a->value == b->value;
+					if (!a->numeric || !b->numeric) return a->to_string() == b->to_string();
+
+					if (a->textual) std::swap(a, b);
+					if (b->textual)
+					{
+						if (a->integral && b->integral && integer_text(b->value)) return a->integer == b->integer;
+						if (std::fabs(a->number - b->number) > 1e-15) return false;
+						return a->to_string() == b->value;
+					}
+
+					if (a->integral && b->integral) return a->integer == b->integer;
+					if (a->integral && !exact_in_double(a->integer)) return numbers_equal(b->number, a->number, a);
+					if (b->integral && !exact_in_double(b->integer)) return numbers_equal(a->number, b->number, b);
+
+					return numbers_equal(a->number, b->number);
 				}
 
-				for (size_t i = 0; i < head->func()->parameter_names.size(); i++)
+				case Type::Func:
+					return false; // todo: compare functions
+
+				case Type::Pending:
+					return this == other.get();
+
+				case Type::Dict:
 				{
-					sym[head->func()->parameter_names[i]] = params[i];
+					auto a = dict(), b = other->dict();
+					if (a->count != b->count) return false;
+
+					for (auto& e : a->entries())
+					{
+						auto found = b->find(e.first->to_string());
+						if (!found || !e.second->compare(*found)) return false;
+					}
+
+					return true;
 				}
 
-				return eli->eval(head->func()->body, sym);
+				case Type::List:
+				{
+					if (auto s = seq()) return s->force()->compare(other);
+					if (auto s = other->seq()) return compare(s->force());
+
+					auto v = vector(), w = other->vector();
+
+					if (!v && !w)
+					{
+						if (list()->values.size() != other->list()->values.size()) return false;
+
+						for (size_t i = 0; i < list()->values.size(); i++)
+							if (!list()->values[i]->compare(other->list()->values[i]))
+								return false;
+
+						return true;
+					}
+
+					if (v && w)
+					{
+						if (v->size() != w->size()) return false;
+
+						for (size_t i = 0; i < v->size(); i++)
+							if (!numbers_equal((*v)[i], (*w)[i]))
+								return false;
+
+						return true;
+					}
+
+					// a vector and a list
+					auto& values = v ? other->list()->values : list()->values;
+					if (!v) v = w;
+
+					if (v->size() != values.size()) return false;
+
+					for (size_t i = 0; i < v->size(); i++)
+					{
+						auto a = values[i]->atom();
+						if (!a) return false;
+
+						if (a->numeric && !a->textual ? !numbers_equal((*v)[i], a->number, a) : Atom::number_to_string((*v)[i]) != a->to_string())
+							return false;
+					}
+
+					return true;
+				}
+				}
+				return true;
 			}
 
-			// CALL Builtin function
-			ELI::NodePtr ELI::Builtin::call(ELI::NodePtr tree, ELI::SymbolTable sym, ELI * eli)
+			// A decimal number: an optional sign, digits with an optional point and an optional exponent
+			// (strtod also reads `inf`, `nan` and hex numbers, which are names here)
+			static bool decimal_number(const std::string& s)
 			{
-				return fn(tree, sym, eli);
+				size_t i = 0, digits = 0;
+				auto digit = [&] { return i < s.size() && s[i] >= '0' && s[i] <= '9'; };
+
+				if (i < s.size() && (s[i] == '+' || s[i] == '-')) i++;
+				for (; digit(); i++) digits++;
+				if (i < s.size() && s[i] == '.') for (i++; digit(); i++) digits++;
+				if (!digits) return false;
+
+				if (i < s.size() && (s[i] == 'e' || s[i] == 'E'))
+				{
+					i++;
+					if (i < s.size() && (s[i] == '+' || s[i] == '-')) i++;
+					if (!digit()) return false;
+					while (digit()) i++;
+				}
+
+				return i == s.size();
 			}
 
-			// Create a new Atom node from string
-			ELI::NodePtr ELI::new_atom(std::string v)
+			ELI::Atom::Atom(std::string v) : Node{ Kind::Atom }, value{ v }, numeric{ false }, textual{ true }, integral{ false }, integer{ 0 }, symbol{ no_symbol }
 			{
-				return std::make_shared<Atom>(v);
+				number = std::strtod(value.c_str(), nullptr);
+				numeric = decimal_number(value);
+
+				if (!numeric) return;
+
+				// integer literals keep all of their 64 bits
+				errno = 0;
+				char* end;
+				auto i = std::strtoll(value.c_str(), &end, 10);
+
+				if (*end == 0 && errno != ERANGE)
+				{
+					integral = true;
+					integer = i;
+				}
+				else if (whole_number(number))
+				{
+					integral = true;
+					integer = (long long)number;
+				}
 			}
 
-			// Create a new Atom node from string
-			ELI::NodePtr ELI::new_atom(const char* v)
+			ELI::Atom::Atom(double d) : Node{ Kind::Atom }, number{ d }, numeric{ true }, textual{ false }, integral{ whole_number(d) && !(d == 0.0 && std::signbit(d)) }, integer{ integral ? (long long)d : 0 }, symbol{ no_symbol }
 			{
-				return std::make_shared<Atom>(std::string{ v });
 			}
 
-			// Create a new Atom node from a double
-			ELI::NodePtr ELI::new_atom(double d)
+			std::string ELI::Atom::number_to_string(double d)
 			{
-				if (std::isnan(d))
-				{
-					return std::make_shared<Atom>("nan");
-				}
+				if (std::isnan(d)) return "nan";
 
 				char chars[64];
 
@@ -172,890 +359,5424 @@ namespace maxy
 				// remove trailing decimal point
 				buf.erase(buf.find_last_not_of(".") + 1);
 
-				return std::make_shared<Atom>(buf);
+				return buf;
 			}
 
-			// Create a new Atom node from a double
-			ELI::NodePtr ELI::new_atom(long long ll)
+			void ELI::Atom::output(std::ostream& os)
 			{
-				return std::make_shared<Atom>(std::to_string(ll));
+				if (textual)
+					os << value;
+				else if (integral)
+					os << integer;
+				else
+					os << number_to_string(number);
 			}
 
-			// Create a new Atom node from a double
-			ELI::NodePtr ELI::new_atom(unsigned long long ull)
+			ELI::Atom::operator bool()
 			{
-				return std::make_shared<Atom>(std::to_string(ull));
+				return number != 0.0l || (textual && value == "true");
 			}
 
-			// Create a new Atom node from a double
-			ELI::NodePtr ELI::new_atom(bool b)
+			void ELI::List::output(std::ostream& os)
 			{
-				return std::make_shared<Atom>(b ? "1" : "");
+				os << '(';
+
+				for (size_t i = 0; i < values.size(); i++)
+				{
+					values[i]->output(os);
+
+					if (i < values.size() - 1) os << ' ';
+				}
+
+				os << ')';
 			}
 
-			// Create a new (empty) List node
-			ELI::NodePtr ELI::new_list()
+			ELI::List::operator bool()
 			{
-				return std::make_shared<List>();
+				return values.size() > 0;
 			}
 
-			// Create a new List node from a vector of strings (the strings are converted to Atoms)
-			ELI::NodePtr ELI::new_list(std::vector<std::string> s)
+			void ELI::Vector::output(std::ostream& os)
 			{
-				auto a = std::make_shared<List>();
-				for (auto str : s)
+				os << '(';
+
+				for (auto i = first; i < last; i++)
 				{
-					a->list()->values.push_back(new_atom(str));
+					if (i > first) os << ' ';
+
+					os << Atom::number_to_string((*buffer)[i]);
 				}
-				return a;
+
+				os << ')';
 			}
 
-			// Create a new Func node
-			ELI::NodePtr ELI::new_func()
+			// Node of the hash array mapped trie. Each level takes 5 bits of the hash: a bit of
+			// `datamap` marks a key kept in this node, a bit of `nodemap` a subtrie. The keys whose
+			// hashes are equal in all the bits are kept in a list in a node below the last level.
+			struct ELI::Dict::Trie
 			{
-				return std::make_shared<Func>();
-			}
+				struct Entry
+				{
+					size_t hash;
+					std::string text;
+					NodePtr key;
+					NodePtr value;
+				};
 
-			// Create a new Builtin node
-			ELI::NodePtr ELI::new_builtin(std::string name, ELI::BuiltinFunc fn)
+				unsigned int datamap = 0;
+				unsigned int nodemap = 0;
+				std::vector<Entry> entries;
+				std::vector<std::shared_ptr<const Trie>> children;
+			};
+
+			using Trie = ELI::Dict::Trie;
+			using TriePtr = std::shared_ptr<const Trie>;
+
+			static const unsigned trie_bits = 5;
+			static const unsigned trie_levels_bits = sizeof(size_t) * 8;
+
+			static unsigned trie_bit(size_t hash, unsigned shift)
 			{
-				return std::make_shared<Builtin>(name, fn);
+				return 1u << ((hash >> shift) & ((1u << trie_bits) - 1));
 			}
 
-
-			// Get variable value (this is called from within Lisp)
-			ELI::NodePtr ELI::get_var(const char* name)
+			// position of the slot for a bit among the slots of the map
+			static size_t trie_index(unsigned int map, unsigned int bit)
 			{
-				auto vararg = variables.find(name);
+				return std::bitset<32>(map & (bit - 1)).count();
+			}
 
-				if (vararg == variables.end())
-					throw Variable_not_found{ name };
+			// Make a trie of two entries whose hashes agree below `shift`
+			static TriePtr trie_pair(Trie::Entry a, Trie::Entry b, unsigned shift)
+			{
+				auto trie = std::make_shared<Trie>();
 
-				auto var = vararg->second;
+				if (shift >= trie_levels_bits)
+				{
+					trie->entries.push_back(std::move(a));
+					trie->entries.push_back(std::move(b));
+					return trie;
+				}
 
-				auto list = new_list();
+				auto bit_a = trie_bit(a.hash, shift), bit_b = trie_bit(b.hash, shift);
 
-				for (size_t i = 0; i < var.components; i++)
-					switch (var.type)
-					{
-					case ExtVar::Type::Double:
-						list->list()->values.push_back(new_atom(var.dptr[i]));
-						break;
-					case ExtVar::Type::Float:
-						list->list()->values.push_back(new_atom(var.fptr[i]));
-						break;
-					case ExtVar::Type::Long:
-						list->list()->values.push_back(new_atom(var.lptr[i]));
-						break;
-					case ExtVar::Type::Int:
-						list->list()->values.push_back(new_atom((long long)var.iptr[i]));
-						break;
-					case ExtVar::Type::Ulong:
-						list->list()->values.push_back(new_atom(var.ulptr[i]));
-						break;
-					case ExtVar::Type::Uint:
-						list->list()->values.push_back(new_atom((unsigned long long)var.uiptr[i]));
-						break;
-					case ExtVar::Type::Bool:
-						list->list()->values.push_back(new_atom((long long)var.bptr[i]));
-						break;
-					}
+				if (bit_a == bit_b)
+				{
+					trie->nodemap = bit_a;
+					trie->children.push_back(trie_pair(std::move(a), std::move(b), shift + trie_bits));
+					return trie;
+				}
 
-				return list;
+				trie->datamap = bit_a | bit_b;
+				if (bit_a > bit_b) std::swap(a, b);
+				trie->entries.push_back(std::move(a));
+				trie->entries.push_back(std::move(b));
+				return trie;
 			}
 
-
-			// Set the variable value (this is called from within Lisp)
-			ELI::NodePtr ELI::set_var(const char* name, NodePtr value)
+			static TriePtr trie_insert(const TriePtr& trie, Trie::Entry entry, unsigned shift, bool& added)
 			{
-				if (!value->is_list())
-					throw Invalid_argument{ value };
-
-				auto vararg = variables.find(name);
+				auto copy = trie ? std::make_shared<Trie>(*trie) : std::make_shared<Trie>();
 
-				if (vararg == variables.end())
-					throw Variable_not_found{ name };
+				if (shift >= trie_levels_bits)
+				{
+					for (auto& e : copy->entries)
+					{
+						if (e.text == entry.text)
+						{
+							e = std::move(entry);
+							return copy;
+						}
+					}
 
-				auto var = vararg->second;
+					copy->entries.push_back(std::move(entry));
+					added = true;
+					return copy;
+				}
 
-				if (var.readonly)
-					throw Write_to_readonly_variable{ name };
+				auto bit = trie_bit(entry.hash, shift);
 
-				if (value->list()->values.size() < var.components)
-					throw Insufficient_arguments{ value };
+				if (copy->datamap & bit)
+				{
+					auto i = trie_index(copy->datamap, bit);
 
-				for (size_t i = 0; i < var.components; i++)
-					switch (var.type)
+					if (copy->entries[i].text == entry.text)
 					{
-					case ExtVar::Type::Double:
-						var.dptr[i] = (double)*value->list()->values[i]->atom();
-						break;
-					case ExtVar::Type::Float:
-						var.fptr[i] = (float)(double)*value->list()->values[i]->atom();
-						break;
-					case ExtVar::Type::Long:
-						var.lptr[i] = (long long)(double)*value->list()->values[i]->atom();
-						break;
-					case ExtVar::Type::Int:
-						var.iptr[i] = (unsigned int)(double)*value->list()->values[i]->atom();
-						break;
-					case ExtVar::Type::Ulong:
-						var.ulptr[i] = (unsigned long long) (double) * value->list()->values[i]->atom();
-						break;
-					case ExtVar::Type::Uint:
-						var.uiptr[i] = (unsigned int)(double)*value->list()->values[i]->atom();
-						break;
-					case ExtVar::Type::Bool:
-						var.bptr[i] = (bool)*value->list()->values[i]->atom();
-						break;
+						copy->entries[i] = std::move(entry);
+						return copy;
 					}
 
-				return new_atom("");
-			}
+					// two keys in one slot move down a level
+					auto child = trie_pair(std::move(copy->entries[i]), std::move(entry), shift + trie_bits);
+					copy->entries.erase(copy->entries.begin() + i);
+					copy->datamap ^= bit;
+					copy->nodemap |= bit;
+					copy->children.insert(copy->children.begin() + trie_index(copy->nodemap, bit), child);
+					added = true;
+				}
+				else if (copy->nodemap & bit)
+				{
+					auto& child = copy->children[trie_index(copy->nodemap, bit)];
+					child = trie_insert(child, std::move(entry), shift + trie_bits, added);
+				}
+				else
+				{
+					copy->datamap |= bit;
+					copy->entries.insert(copy->entries.begin() + trie_index(copy->datamap, bit), std::move(entry));
+					added = true;
+				}
 
-			// Register an External Function
-			void ELI::func(const char* name, ExtFunc p)
-			{
-				functions[name] = p;
+				return copy;
 			}
 
-			// ELI constructor
-			ELI::ELI()
+			// The trie without a key (the same trie if it has no such key, null if it becomes empty)
+			static TriePtr trie_remove(const TriePtr& trie, size_t hash, const std::string& text, unsigned shift)
 			{
-				// Language primitives
-				builtins["seq"] = BUILTIN_SIGNATURE{
-					if (VAL_SIZE == 0) return eli->new_atom("");
+				if (shift >= trie_levels_bits)
+				{
+					for (size_t i = 0; i < trie->entries.size(); i++)
+					{
+						if (trie->entries[i].text != text) continue;
+						if (trie->entries.size() == 1) return nullptr;
+
+						auto copy = std::make_shared<Trie>(*trie);
+						copy->entries.erase(copy->entries.begin() + i);
+						return copy;
+					}
+
+					return trie;
+				}
+
+				auto bit = trie_bit(hash, shift);
+
+				if (trie->datamap & bit)
+				{
+					auto i = trie_index(trie->datamap, bit);
+					if (trie->entries[i].text != text) return trie;
+					if (trie->entries.size() == 1 && trie->children.empty()) return nullptr;
+
+					auto copy = std::make_shared<Trie>(*trie);
+					copy->entries.erase(copy->entries.begin() + i);
+					copy->datamap ^= bit;
+					return copy;
+				}
+
+				if (!(trie->nodemap & bit)) return trie;
+
+				auto j = trie_index(trie->nodemap, bit);
+				auto child = trie_remove(trie->children[j], hash, text, shift + trie_bits);
+				if (child == trie->children[j]) return trie;
+
+				auto copy = std::make_shared<Trie>(*trie);
+
+				if (!child)
+				{
+					copy->children.erase(copy->children.begin() + j);
+					copy->nodemap ^= bit;
+					if (copy->entries.empty() && copy->children.empty()) return nullptr;
+				}
+				else if (child->children.empty() && child->entries.size() == 1)
+				{
+					// a subtrie of one key is kept in this node instead
+					copy->children.erase(copy->children.begin() + j);
+					copy->nodemap ^= bit;
+					copy->datamap |= bit;
+					copy->entries.insert(copy->entries.begin() + trie_index(copy->datamap, bit), child->entries[0]);
+				}
+				else
+				{
+					copy->children[j] = child;
+				}
+
+				return copy;
+			}
+
+			static void trie_collect(const Trie* trie, std::vector<const Trie::Entry*>& out)
+			{
+				if (!trie) return;
+
+				for (auto& e : trie->entries) out.push_back(&e);
+				for (auto& c : trie->children) trie_collect(c.get(), out);
+			}
+
+			// Find the value of a key
+			const ELI::NodePtr* ELI::Dict::find(const std::string& text) const
+			{
+				auto hash = std::hash<std::string>{}(text);
+				auto trie = root.get();
+
+				for (unsigned shift = 0; trie; shift += trie_bits)
+				{
+					if (shift >= trie_levels_bits)
+					{
+						for (auto& e : trie->entries)
+							if (e.text == text) return &e.value;
+
+						return nullptr;
+					}
+
+					auto bit = trie_bit(hash, shift);
+
+					if (trie->datamap & bit)
+					{
+						auto& e = trie->entries[trie_index(trie->datamap, bit)];
+						return e.text == text ? &e.value : nullptr;
+					}
+
+					if (!(trie->nodemap & bit)) return nullptr;
+
+					trie = trie->children[trie_index(trie->nodemap, bit)].get();
+				}
+
+				return nullptr;
+			}
+
+			// Set the value of a key (the key and the value are shared, dicts are cheap to publish)
+			void ELI::Dict::insert(const NodePtr& key, const NodePtr& value)
+			{
+				key->share();
+				value->share();
+
+				auto text = key->to_string();
+				auto hash = std::hash<std::string>{}(text);
+				auto added = false;
+
+				root = trie_insert(root, Trie::Entry{ hash, std::move(text), key, value }, 0, added);
+				if (added) count++;
+			}
+
+			// Remove a key
+			bool ELI::Dict::remove(const std::string& text)
+			{
+				if (!root) return false;
+
+				auto trie = trie_remove(root, std::hash<std::string>{}(text), text, 0);
+				if (trie == root) return false;
+
+				root = trie;
+				count--;
+				return true;
+			}
+
+			// The keys and their values ordered by the keys
+			std::vector<std::pair<ELI::NodePtr, ELI::NodePtr>> ELI::Dict::entries() const
+			{
+				std::vector<const Trie::Entry*> found;
+				found.reserve(count);
+				trie_collect(root.get(), found);
+
+				std::sort(found.begin(), found.end(), [](const Trie::Entry* a, const Trie::Entry* b) { return a->text < b->text; });
+
+				std::vector<std::pair<NodePtr, NodePtr>> result;
+				result.reserve(found.size());
+				for (auto e : found) result.emplace_back(e->key, e->value);
+
+				return result;
+			}
+
+			// A dict is printed as the call that makes it, so the text reads back as the same dict
+			void ELI::Dict::output(std::ostream& os)
+			{
+				os << "(dict";
+
+				for (auto& e : entries())
+				{
+					os << ' ';
+					e.first->output(os);
+					os << ' ';
+					e.second->output(os);
+				}
+
+				os << ')';
+			}
+
+			// Bind a name in the frame
+			void ELI::Frame::bind(SymbolId name, NodePtr value)
+			{
+				for (auto& b : bindings)
+				{
+					if (b.first == name)
+					{
+						b.second = value;
+						return;
+					}
+				}
+
+				bindings.emplace_back(name, value);
+				mask |= name_bit(name);
+			}
+
+			// Find the innermost binding of a name
+			const ELI::NodePtr* ELI::Frame::find(SymbolId name) const
+			{
+				if (!(mask & name_bit(name))) return nullptr;
+
+				for (auto frame = this; frame; frame = frame->parent.get())
+				{
+					for (auto& b : frame->bindings)
+						if (b.first == name) return &b.second;
+				}
+
+				return nullptr;
+			}
+
+			ELI::ListValues::Storage::Storage(size_t c, size_t at) : data{ static_cast<NodePtr*>(::operator new(c * sizeof(NodePtr))) }, capacity{ c }, lo{ at }, hi{ at }
+			{
+			}
+
+			ELI::ListValues::Storage::~Storage()
+			{
+				for (auto i = lo.load(std::memory_order_relaxed); i < hi.load(std::memory_order_relaxed); i++) data[i].~NodePtr();
+				::operator delete(data);
+			}
+
+			// Take the free slot before the slice
+			bool ELI::ListValues::claim_front()
+			{
+				if (!storage || first == 0) return false;
+
+				// the only owner does not race with anybody
+				if (storage.use_count() == 1)
+				{
+					if (storage->lo.load(std::memory_order_relaxed) != first) return false;
+					storage->lo.store(first - 1, std::memory_order_relaxed);
+					return true;
+				}
+
+				auto expected = first;
+				return storage->lo.compare_exchange_strong(expected, first - 1);
+			}
+
+			// Take the free slot after the slice
+			bool ELI::ListValues::claim_back()
+			{
+				if (!storage || last == storage->capacity) return false;
+
+				if (storage.use_count() == 1)
+				{
+					if (storage->hi.load(std::memory_order_relaxed) != last) return false;
+					storage->hi.store(last + 1, std::memory_order_relaxed);
+					return true;
+				}
+
+				auto expected = last;
+				return storage->hi.compare_exchange_strong(expected, last + 1);
+			}
+
+			// Copy the slice into a new buffer
+			void ELI::ListValues::relocate(size_t capacity, size_t at)
+			{
+				auto count = size();
+				auto copy = std::make_shared<Storage>(capacity, at);
+
+				for (size_t i = 0; i < count; i++) new(copy->data + at + i) NodePtr(storage->data[first + i]);
+				copy->hi.store(at + count, std::memory_order_relaxed);
+
+				storage = std::move(copy);
+				first = at;
+				last = at + count;
+			}
+
+			// Replace an element
+			void ELI::ListValues::set(size_t i, NodePtr value)
+			{
+				if (storage.use_count() != 1) relocate(size(), 0);
+				storage->data[first + i] = std::move(value);
+			}
+
+			void ELI::ListValues::push_back(NodePtr value)
+			{
+				if (!claim_back())
+				{
+					relocate(size() * 2 + 4, 0);
+					storage->hi.store(last + 1, std::memory_order_relaxed);
+				}
+
+				new(storage->data + last) NodePtr(std::move(value));
+				last++;
+			}
+
+			void ELI::ListValues::push_front(NodePtr value)
+			{
+				if (!claim_front())
+				{
+					// leave as much room before the elements as there are elements
+					auto count = size();
+					relocate(count * 2 + 4, count + 4);
+					storage->lo.store(first - 1, std::memory_order_relaxed);
+				}
+
+				first--;
+				new(storage->data + first) NodePtr(std::move(value));
+			}
+
+			void ELI::ListValues::reserve(size_t count)
+			{
+				if (count <= size()) return;
+				if (storage && storage.use_count() == 1 && storage->hi.load(std::memory_order_relaxed) == last && storage->capacity - first >= count) return;
+
+				relocate(count, 0);
+			}
+
+			void ELI::ListValues::clear()
+			{
+				storage.reset();
+				first = last = 0;
+			}
+
+			// Elements [from, to) sharing the buffer
+			ELI::ListValues ELI::ListValues::slice(size_t from, size_t to) const
+			{
+				auto result = *this;
+				result.first = first + from;
+				result.last = first + to;
+				return result;
+			}
+
+			// Unlink the parent frames that are completely shadowed by this frame
+			void ELI::Frame::skip_shadowed()
+			{
+				auto shadowed = [&](const Frame& frame) {
+					for (auto& b : frame.bindings)
+					{
+						auto found = std::find_if(bindings.begin(), bindings.end(), [&](const std::pair<SymbolId, NodePtr>& own) { return own.first == b.first; });
+						if (found == bindings.end()) return false;
+					}
+					return true;
+				};
+
+				if (!parent || !shadowed(*parent)) return;
+
+				while (parent && shadowed(*parent)) parent = parent->parent;
+
+				mask = parent ? parent->mask : 0;
+				for (auto& b : bindings) mask |= name_bit(b.first);
+			}
+
+			// Release a chain of frames without recursion
+			ELI::Frame::~Frame()
+			{
+				auto p = std::move(parent);
+
+				while (p && p.use_count() == 1)
+				{
+					auto next = std::move(p->parent);
+					p = std::move(next);
+				}
+			}
+
+			// CALL Lisp function
+			ELI::NodePtr ELI::Func::call(const ELI::NodePtr& tree, const ELI::Env& sym, ELI *eli)
+			{
+				auto frame = enter(tree, sym, eli);
+
+				if (code) return eli->execute(code, entry, frame);
+
+				return eli->eval(body, frame);
+			}
+
+			// Call with arguments that are already evaluated
+			ELI::NodePtr ELI::Func::apply(const NodePtr* args, const Env& sym, ELI* eli)
+			{
+				auto count = parameter_names.size();
+				auto frame = eli->new_frame(sym);
+				frame->bindings.reserve(count);
+
+				for (size_t i = 0; i < count; i++)
+					frame->bind(i < parameters.size() ? parameters[i] : eli->intern(parameter_names[i]), args[i]);
+
+				if (code) return eli->execute(code, entry, frame);
+
+				return eli->eval(body, frame);
+			}
+
+			// Bind the arguments of a call
+			ELI::Env ELI::Func::enter(const ELI::NodePtr& tree, const ELI::Env& sym, ELI *eli)
+			{
+				auto count = parameter_names.size();
+
+				if (VAL_SIZE < count + 1) throw Insufficient_arguments{ tree };
+
+				// parameters are evaluated in the caller's scope and bound in a frame of their own
+				auto frame = eli->new_frame(sym);
+				frame->bindings.reserve(count);
+
+				for (size_t i = 0; i < count; i++)
+				{
+					auto id = i < parameters.size() ? parameters[i] : eli->intern(parameter_names[i]);
+					frame->bind(id, eli->eval(VALUES(tree)[1 + i], sym));
+				}
+
+				return frame;
+			}
+
+			// CALL Builtin function
+			ELI::NodePtr ELI::Builtin::call(const ELI::NodePtr& tree, const ELI::Env& sym, ELI * eli)
+			{
+				return fn(tree, sym, eli);
+			}
+
+			// Thread-local pools of fixed-size blocks for the nodes and frames. The chunks are
+			// never returned to the system, so a block may be freed by any thread; the free
+			// blocks of a finished thread go to the shared lists.
+			struct FreeBlock
+			{
+				FreeBlock* next;
+			};
+
+			static const size_t pool_granularity = 16;
+			static const size_t pool_classes = 16;
+			static const size_t pool_chunk_size = 64 * 1024;
+
+			struct SharedFreeLists
+			{
+				std::mutex mutex;
+				FreeBlock* lists[pool_classes] = {};
+			};
+
+			// never destroyed, blocks may be freed during the static destruction
+			static SharedFreeLists& shared_free_lists()
+			{
+				static auto lists = new SharedFreeLists;
+				return *lists;
+			}
+
+			static thread_local FreeBlock* thread_free_lists[pool_classes];
+			static thread_local bool thread_pool_flushed = false;
+
+			struct ThreadPoolFlusher
+			{
+				bool registered = false;
+
+				~ThreadPoolFlusher()
+				{
+					auto& shared = shared_free_lists();
+					auto x = std::lock_guard<std::mutex>(shared.mutex);
+
+					for (size_t c = 0; c < pool_classes; c++)
+					{
+						while (auto block = thread_free_lists[c])
+						{
+							thread_free_lists[c] = block->next;
+							block->next = shared.lists[c];
+							shared.lists[c] = block;
+						}
+					}
+
+					thread_pool_flushed = true;
+				}
+			};
+
+			static thread_local ThreadPoolFlusher thread_pool_flusher;
+
+			// Get free blocks of a size class from the shared lists or a new chunk
+			static FreeBlock* refill_pool(size_t c)
+			{
+				auto& shared = shared_free_lists();
+
+				{
+					auto x = std::lock_guard<std::mutex>(shared.mutex);
+
+					if (auto list = shared.lists[c])
+					{
+						shared.lists[c] = nullptr;
+						return list;
+					}
+				}
+
+				auto block_size = (c + 1) * pool_granularity;
+				auto chunk = static_cast<char*>(::operator new(pool_chunk_size));
+				FreeBlock* list = nullptr;
+
+				for (auto offset = pool_chunk_size / block_size * block_size; offset > 0; offset -= block_size)
+				{
+					auto block = reinterpret_cast<FreeBlock*>(chunk + offset - block_size);
+					block->next = list;
+					list = block;
+				}
+
+				return list;
+			}
+
+			static void* pool_allocate(size_t size)
+			{
+				auto c = (size + pool_granularity - 1) / pool_granularity - 1;
+				if (size == 0 || c >= pool_classes) return ::operator new(size);
+
+				if (thread_pool_flushed)
+				{
+					// the thread is finishing, its own lists are gone; the block goes to the shared lists when freed
+					return ::operator new((c + 1) * pool_granularity);
+				}
+
+				auto& list = thread_free_lists[c];
+				if (!list)
+				{
+					// make sure the free lists are handed over when the thread finishes
+					thread_pool_flusher.registered = true;
+					list = refill_pool(c);
+				}
+
+				auto block = list;
+				list = block->next;
+				return block;
+			}
+
+			static void pool_deallocate(void* block, size_t size)
+			{
+				auto c = (size + pool_granularity - 1) / pool_granularity - 1;
+				if (size == 0 || c >= pool_classes)
+				{
+					::operator delete(block);
+					return;
+				}
+
+				auto free_block = static_cast<FreeBlock*>(block);
+
+				if (thread_pool_flushed)
+				{
+					auto& shared = shared_free_lists();
+					auto x = std::lock_guard<std::mutex>(shared.mutex);
+					free_block->next = shared.lists[c];
+					shared.lists[c] = free_block;
+					return;
+				}
+
+				free_block->next = thread_free_lists[c];
+				thread_free_lists[c] = free_block;
+			}
+
+			const ELI::Allocator ELI::pool_allocator = { pool_allocate, pool_deallocate };
+
+			const ELI::Allocator ELI::heap_allocator = {
+				[](size_t size) { return ::operator new(size); },
+				[](void* block, size_t) { ::operator delete(block); }
+			};
+
+			// The contexts read the registries and settings without locking, so they are fixed while any exist
+			void ELI::ensure_mutable(const char* what)
+			{
+				if (contexts.load()) throw Image_in_use{ what };
+			}
+
+			// Set the allocator for the nodes and frames
+			void ELI::set_allocator(Allocator a)
+			{
+				ensure_mutable("set the allocator");
+				allocator = a;
+			}
+
+			// The context running on this thread and its allocator (see ELI::Context)
+			static thread_local const ELI* context_image = nullptr;
+			static thread_local ELI::Allocator context_allocator;
+
+			const ELI::Allocator& ELI::current_allocator() const
+			{
+				return context_image == this ? context_allocator : allocator;
+			}
+
+			// Allocate a node
+			template<typename Ty, typename... Args>
+			ELI::NodeRef<Ty> ELI::make_node(Args&&... args)
+			{
+				static_assert(sizeof(Ty) <= 0xffff, "node is too big");
+
+				auto& allocator = current_allocator();
+				auto block = allocator.allocate(sizeof(Ty));
+				Ty* node;
+
+				try
+				{
+					node = new(block) Ty(std::forward<Args>(args)...);
+				}
+				catch (...)
+				{
+					allocator.deallocate(block, sizeof(Ty));
+					throw;
+				}
+
+				node->deallocate = allocator.deallocate;
+				node->block_size = sizeof(Ty);
+				return NodeRef<Ty>(node);
+			}
+
+			// Free a node when its last reference is gone
+			void ELI::Node::destroy(const Node* node)
+			{
+				auto block = const_cast<Node*>(node);
+				auto deallocate = block->deallocate;
+				auto size = block->block_size;
+
+				if (!deallocate)
+				{
+					delete block;
+					return;
+				}
+
+				block->~Node();
+				deallocate(block, size);
+			}
+
+			// Mark the node and everything it refers to as reachable from several threads
+			void ELI::Node::share()
+			{
+				if (shared) return;
+				shared = true;
+
+				if (kind == Kind::List)
+				{
+					for (auto& v : list()->values) if (v) v->share();
+				}
+				else if (auto f = func())
+				{
+					if (f->body) f->body->share();
+				}
+				else if (auto s = seq())
+				{
+					// other threads only see the elements
+					s->force()->share();
+				}
+				// the keys and values of a dict are shared when they are put in
+			}
+
+			// The elements of a packed vector or a lazy sequence for the code that reads them as a List
+			ELI::List* ELI::Node::elements()
+			{
+				if (auto v = vector()) return v->unpacked();
+				if (auto s = seq()) return s->force()->list();
+
+				return nullptr;
+			}
+
+			// Unpack the numbers into atoms once, other threads may ask for them at the same time
+			ELI::List* ELI::Vector::unpacked()
+			{
+				std::call_once(unpack_once, [this] {
+					auto list = new List();
+					list->values.reserve(size());
+					for (auto d : *this) list->values.push_back(NodePtr(new Atom(d)));
+
+					unpacked_list = NodePtr(list);
+					if (is_shared()) unpacked_list->share();
+				});
+
+				return static_cast<List*>(unpacked_list.get());
+			}
+
+			// Create a new local frame on top of the given environment
+			ELI::Env ELI::new_frame(const Env& parent)
+			{
+				auto& allocator = current_allocator();
+				return std::allocate_shared<Frame>(NodeAllocator<Frame>(allocator), parent, allocator);
+			}
+
+			// Create a new Atom node from string
+			ELI::NodePtr ELI::new_atom(std::string v)
+			{
+				return make_node<Atom>(v);
+			}
+
+			// Create a new Atom node from string
+			ELI::NodePtr ELI::new_atom(const char* v)
+			{
+				return make_node<Atom>(std::string{ v });
+			}
+
+			// Create a new Atom node from a double
+			ELI::NodePtr ELI::new_atom(double d)
+			{
+				return make_node<Atom>(d);
+			}
+
+			// Create a new Atom node from an integer
+			ELI::NodePtr ELI::new_atom(long long ll)
+			{
+				return make_node<Atom>(ll);
+			}
+
+			// Create a new Atom node from an unsigned integer
+			ELI::NodePtr ELI::new_atom(unsigned long long ull)
+			{
+				if (ull <= (unsigned long long)LLONG_MAX) return make_node<Atom>((long long)ull);
+
+				// past the range of long long only the text is exact
+				return make_node<Atom>(std::to_string(ull), (double)ull);
+			}
+
+			// Create a new Atom node from a double
+			ELI::NodePtr ELI::new_atom(bool b)
+			{
+				return make_node<Atom>(b ? "1" : "");
+			}
+
+			// Create a new (empty) List node
+			ELI::NodePtr ELI::new_list()
+			{
+				return make_node<List>();
+			}
+
+			// Create a new List node from a vector of strings (the strings are converted to Atoms)
+			ELI::NodePtr ELI::new_list(std::vector<std::string> s)
+			{
+				auto a = make_node<List>();
+				for (auto str : s)
+				{
+					a->list()->values.push_back(new_atom(str));
+				}
+				return a;
+			}
+
+			// Create a new Vector node
+			ELI::NodePtr ELI::new_vector(std::vector<double> numbers)
+			{
+				return make_node<Vector>(std::move(numbers));
+			}
+
+			// Create a new Vector node sharing the buffer of a vector
+			ELI::NodePtr ELI::new_vector(const Vector& source, size_t from, size_t to)
+			{
+				return make_node<Vector>(source.buffer, source.first + from, source.first + to);
+			}
+
+			// Create a new (empty) Seq node
+			ELI::NodePtr ELI::new_seq()
+			{
+				return make_node<Seq>(this);
+			}
+
+			// Create a new (empty) Dict node
+			ELI::NodePtr ELI::new_dict()
+			{
+				return make_node<Dict>();
+			}
+
+			// Create a new Dict node holding the same entries as a dict (the trie is shared)
+			ELI::NodePtr ELI::new_dict(const Dict& source)
+			{
+				return make_node<Dict>(source);
+			}
+
+			// Create a new Pending node
+			ELI::NodePtr ELI::new_pending(std::shared_future<std::vector<std::string>> result)
+			{
+				return make_node<Pending>(std::move(result));
+			}
+
+			// Create a new Func node
+			ELI::NodePtr ELI::new_func()
+			{
+				return make_node<Func>();
+			}
+
+			// Create a new Builtin node
+			ELI::NodePtr ELI::new_builtin(std::string name, ELI::BuiltinFunc fn)
+			{
+				return make_node<Builtin>(name, fn);
+			}
+
+
+			// Get variable value (this is called from within Lisp)
+			ELI::NodePtr ELI::get_var(const char* name)
+			{
+				auto vararg = variables.find(name);
+
+				if (vararg == variables.end())
+					throw Variable_not_found{ name };
+
+				auto var = vararg->second;
+
+				std::vector<double> numbers(var.components);
+				// 64-bit integers beyond 2^53 do not fit into a double exactly
+				auto exact = true;
+
+				for (size_t i = 0; i < var.components; i++)
+					switch (var.type)
+					{
+					case ExtVar::Type::Double:
+						numbers[i] = var.dptr[i];
+						break;
+					case ExtVar::Type::Float:
+						numbers[i] = var.fptr[i];
+						break;
+					case ExtVar::Type::Long:
+						numbers[i] = (double)var.lptr[i];
+						exact = exact && exact_in_double(var.lptr[i]);
+						break;
+					case ExtVar::Type::Int:
+						numbers[i] = var.iptr[i];
+						break;
+					case ExtVar::Type::Ulong:
+						numbers[i] = (double)var.ulptr[i];
+						exact = exact && var.ulptr[i] <= (unsigned long long)max_exact_integer;
+						break;
+					case ExtVar::Type::Uint:
+						numbers[i] = var.uiptr[i];
+						break;
+					case ExtVar::Type::Bool:
+						numbers[i] = var.bptr[i] ? 1 : 0;
+						break;
+					}
+
+				if (exact) return new_vector(std::move(numbers));
+
+				// such values keep their exact value in a list of integer atoms
+				auto list = new_list();
+
+				for (size_t i = 0; i < var.components; i++)
+					switch (var.type)
+					{
+					case ExtVar::Type::Long:
+						VALUES(list).push_back(new_atom((long long)var.lptr[i]));
+						break;
+					case ExtVar::Type::Ulong:
+						VALUES(list).push_back(new_atom((unsigned long long)var.ulptr[i]));
+						break;
+					default:
+						VALUES(list).push_back(new_atom(numbers[i]));
+						break;
+					}
+
+				return list;
+			}
+
+
+			// Exact value of an atom for a 64-bit variable
+			static long long atom_to_long(ELI::Atom* atom)
+			{
+				return atom->integral ? atom->integer : (long long)atom->number;
+			}
+
+			static unsigned long long atom_to_ulong(ELI::Atom* atom)
+			{
+				if (atom->integral) return (unsigned long long)atom->integer;
+
+				// past the range of long long only the text is exact
+				if (atom->numeric && atom->textual)
+				{
+					char* end;
+					errno = 0;
+					auto u = std::strtoull(atom->value.c_str(), &end, 10);
+					if (*end == 0 && errno != ERANGE) return u;
+				}
+
+				return (unsigned long long)atom->number;
+			}
+
+			// Set the variable value (this is called from within Lisp)
+			ELI::NodePtr ELI::set_var(const char* name, NodePtr value)
+			{
+				if (!value->is_list())
+					throw Invalid_argument{ value };
+
+				if (auto s = value->seq()) value = s->force();
+
+				auto vararg = variables.find(name);
+
+				if (vararg == variables.end())
+					throw Variable_not_found{ name };
+
+				auto var = vararg->second;
+
+				if (var.readonly)
+					throw Write_to_readonly_variable{ name };
+
+				if (auto v = value->vector())
+				{
+					if (v->size() < var.components)
+						throw Insufficient_arguments{ value };
+
+					for (size_t i = 0; i < var.components; i++)
+						switch (var.type)
+						{
+						case ExtVar::Type::Double:
+							var.dptr[i] = (*v)[i];
+							break;
+						case ExtVar::Type::Float:
+							var.fptr[i] = (float)(*v)[i];
+							break;
+						case ExtVar::Type::Long:
+							var.lptr[i] = (long long)(*v)[i];
+							break;
+						case ExtVar::Type::Int:
+							var.iptr[i] = (unsigned int)(*v)[i];
+							break;
+						case ExtVar::Type::Ulong:
+							var.ulptr[i] = (unsigned long long)(*v)[i];
+							break;
+						case ExtVar::Type::Uint:
+							var.uiptr[i] = (unsigned int)(*v)[i];
+							break;
+						case ExtVar::Type::Bool:
+							var.bptr[i] = (*v)[i] != 0.0;
+							break;
+						}
+
+					return new_atom("");
+				}
+
+				if (value->list()->values.size() < var.components)
+					throw Insufficient_arguments{ value };
+
+				for (size_t i = 0; i < var.components; i++)
+					switch (var.type)
+					{
+					case ExtVar::Type::Double:
+						var.dptr[i] = (double)*value->list()->values[i]->atom();
+						break;
+					case ExtVar::Type::Float:
+						var.fptr[i] = (float)(double)*value->list()->values[i]->atom();
+						break;
+					case ExtVar::Type::Long:
+						var.lptr[i] = atom_to_long(value->list()->values[i]->atom());
+						break;
+					case ExtVar::Type::Int:
+						var.iptr[i] = (unsigned int)(double)*value->list()->values[i]->atom();
+						break;
+					case ExtVar::Type::Ulong:
+						var.ulptr[i] = atom_to_ulong(value->list()->values[i]->atom());
+						break;
+					case ExtVar::Type::Uint:
+						var.uiptr[i] = (unsigned int)(double)*value->list()->values[i]->atom();
+						break;
+					case ExtVar::Type::Bool:
+						var.bptr[i] = (bool)*value->list()->values[i]->atom();
+						break;
+					}
+
+				return new_atom("");
+			}
+
+			// Register an External Function
+			void ELI::func(const char* name, ExtFunc p)
+			{
+				ensure_mutable("register a function");
+				functions[name] = p;
+			}
+
+			// Register an asynchronous External Function
+			void ELI::func_async(const char* name, AsyncExtFunc p)
+			{
+				ensure_mutable("register a function");
+				async_functions[name] = p;
+			}
+
+			// Version of the global symbol table. The values live in leaves of 16 slots, grouped into chunks
+			// of 256; the versions share them, so a new version copies the chunk pointers and the one chunk
+			// and leaf it changes. A version nobody else reads is changed in place (see set).
+			struct ELI::Globals
+			{
+				static const size_t chunk_size = 256;
+				static const size_t leaf_size = 16;
+				static const size_t max_chunks = 4096;
+
+				using Leaf = std::array<NodePtr, leaf_size>;
+				using Chunk = std::array<std::shared_ptr<Leaf>, chunk_size / leaf_size>;
+
+				std::vector<std::shared_ptr<Chunk>> chunks;
+				// tells the cached resolutions of names apart (see ELI::resolve), unique for every version
+				unsigned long long version;
+				// leases holding this version
+				std::atomic<size_t> readers;
+				// stored in ELI::globals, otherwise the version is private to the run that made it by `def`
+				bool published;
+
+				Globals(bool p) : version{ next_version() }, readers{ 0 }, published{ p } {}
+
+				static unsigned long long next_version()
+				{
+					static std::atomic<unsigned long long> last{ 0 };
+					return ++last;
+				}
+
+				// Get the value of a name (nullptr if it has none)
+				const NodePtr* find(SymbolId id) const
+				{
+					auto c = id / chunk_size;
+					if (c >= chunks.size() || !chunks[c]) return nullptr;
+
+					auto& leaf = (*chunks[c])[id % chunk_size / leaf_size];
+					if (!leaf) return nullptr;
+
+					auto& slot = (*leaf)[id % leaf_size];
+					return slot ? &slot : nullptr;
+				}
+
+				// Make a part of the path to a slot this version's own, copying it if another version shares it
+				template<typename Part>
+				static void own(std::shared_ptr<Part>& part)
+				{
+					if (!part) part = std::make_shared<Part>();
+					else if (part.use_count() > 1) part = std::make_shared<Part>(*part);
+					// the other versions that had the part are done with it
+					else std::atomic_thread_fence(std::memory_order_acquire);
+				}
+
+				// The slot of a name, owned by this version
+				NodePtr& slot(SymbolId id)
+				{
+					auto c = id / chunk_size;
+					if (c >= chunks.size()) chunks.resize(c + 1);
+
+					own(chunks[c]);
+					auto& leaf = (*chunks[c])[id % chunk_size / leaf_size];
+					own(leaf);
+
+					return (*leaf)[id % leaf_size];
+				}
+
+				// A new version with one value replaced
+				Globals* with(SymbolId id, NodePtr value, bool publish) const
+				{
+					auto next = new Globals(publish);
+					next->chunks = chunks;
+					next->slot(id) = std::move(value);
+
+					return next;
+				}
+
+				// Replace a value in a private version only its run reads; the new number keeps
+				// the resolutions cached for the old contents from being used
+				void set(SymbolId id, NodePtr value)
+				{
+					slot(id) = std::move(value);
+					version = next_version();
+				}
+
+				// Nothing but the run that made it reads this version
+				bool exclusive() const { return !published && readers.load() == 1; }
+			};
+
+			// Open addressing table of the interned identifiers. Lookups do not lock: interning (under
+			// intern_mutex) only fills empty slots, and a table that gets half full is replaced by a copy
+			// twice as big. The replaced tables stay until the interpreter is destroyed, as readers may
+			// still probe them.
+			struct ELI::Symbols
+			{
+				struct Entry
+				{
+					std::string name;
+					SymbolId id;
+				};
+
+				struct Slots
+				{
+					size_t mask;
+					std::unique_ptr<std::atomic<const Entry*>[]> slot;
+
+					Slots(size_t size) : mask{ size - 1 }, slot{ new std::atomic<const Entry*>[size] }
+					{
+						for (size_t i = 0; i < size; i++) slot[i].store(nullptr, std::memory_order_relaxed);
+					}
+
+					void insert(const Entry* entry)
+					{
+						auto i = std::hash<std::string>{}(entry->name) & mask;
+						while (slot[i].load(std::memory_order_relaxed)) i = (i + 1) & mask;
+						slot[i].store(entry, std::memory_order_release);
+					}
+				};
+
+				// the entries do not move, the slots of all the tables point to them
+				std::deque<Entry> entries;
+				std::vector<std::unique_ptr<Slots>> tables;
+				std::atomic<Slots*> current;
+
+				Symbols()
+				{
+					tables.emplace_back(new Slots(1024));
+					current.store(tables.back().get());
+				}
+
+				SymbolId find(const std::string& name) const
+				{
+					auto t = current.load(std::memory_order_acquire);
+
+					for (auto i = std::hash<std::string>{}(name) & t->mask; ; i = (i + 1) & t->mask)
+					{
+						auto entry = t->slot[i].load(std::memory_order_acquire);
+						if (!entry) return no_symbol;
+						if (entry->name == name) return entry->id;
+					}
+				}
+
+				// Add a name that is not in the table yet (the caller holds intern_mutex)
+				SymbolId add(const std::string& name)
+				{
+					entries.push_back({ name, (SymbolId)entries.size() });
+
+					auto t = current.load(std::memory_order_relaxed);
+
+					if (entries.size() * 2 > t->mask + 1)
+					{
+						tables.emplace_back(new Slots((t->mask + 1) * 2));
+						for (auto& e : entries) tables.back()->insert(&e);
+						current.store(tables.back().get(), std::memory_order_release);
+					}
+					else t->insert(&entries.back());
+
+					return entries.back().id;
+				}
+			};
+
+			// Get the id of an identifier, interning it if it is new
+			ELI::SymbolId ELI::intern(const std::string& name)
+			{
+				auto id = symbol_ids->find(name);
+				if (id != no_symbol) return id;
+
+				auto x = std::lock_guard<std::mutex>(intern_mutex);
+
+				id = symbol_ids->find(name);
+				if (id != no_symbol) return id;
+
+				// the global table is full, the identifier stays a plain atom
+				if (symbol_ids->entries.size() >= Globals::chunk_size * Globals::max_chunks)
+					return no_symbol;
+
+				return symbol_ids->add(name);
+			}
+
+			// Get the id of an identifier if it has been interned
+			ELI::SymbolId ELI::find_symbol(const std::string& name)
+			{
+				return symbol_ids->find(name);
+			}
+
+			// Unpack a vector into a list of atoms
+			static ELI::NodePtr unpack(ELI* eli, const ELI::NodePtr& node)
+			{
+				auto v = node->vector();
+				if (!v) return node;
+
+				auto list = eli->new_list();
+				VALUES(list).reserve(v->size());
+
+				for (auto d : *v) VALUES(list).push_back(eli->new_atom(d));
+
+				return list;
+			}
+
+			// Check if an atom can be packed into a vector (it prints the same as its number)
+			static bool packable(const ELI::NodePtr& node)
+			{
+				auto atom = node->atom();
+				return atom && atom->numeric && (!atom->integral || exact_in_double(atom->integer)) &&
+					(!atom->textual || atom->value == ELI::Atom::number_to_string(atom->number));
+			}
+
+			// Add the numbers of a list to a vector (false if it holds anything else)
+			static bool append_numbers(std::vector<double>& numbers, const ELI::NodePtr& node)
+			{
+				if (auto v = node->vector())
+				{
+					numbers.insert(numbers.end(), v->begin(), v->end());
+					return true;
+				}
+
+				for (auto& value : VALUES(node))
+				{
+					if (!packable(value)) return false;
+					numbers.push_back(value->atom()->number);
+				}
+
+				return true;
+			}
+
+			// Elementwise operation of a builtin over numbers
+			struct ELI::Kernel
+			{
+				void (*unary)(const double* a, double* result, size_t count);
+				void (*binary)(const double* a, const double* b, double* result, size_t count);
+				// left and right folds of a binary operation (null for truth values)
+				double (*fold_left)(double accum, const double* a, size_t count);
+				double (*fold_right)(double accum, const double* a, size_t count);
+				// exact version of the operation on whole numbers (see add_integers)
+				bool (*integer)(long long a, long long b, long long& result);
+				// the results are truth values ("1" and "") rather than numbers
+				bool boolean;
+				// the builtin only looks at the numbers of its atoms (not at their text)
+				bool by_number;
+			};
+
+			// Operations of the kernels: `scalar` gives exactly what the builtin gives,
+			// `avx2` and `sse2` tell if there are versions for those instruction sets
+			struct AddOp
+			{
+				static const bool avx2 = true, sse2 = true, boolean = false;
+				static double scalar(double a, double b) { return a + b; }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a, __m256d b) { return _mm256_add_pd(a, b); }
+				static __m128d sse2_op(__m128d a, __m128d b) { return _mm_add_pd(a, b); }
+#endif
+			};
+
+			struct SubOp
+			{
+				static const bool avx2 = true, sse2 = true, boolean = false;
+				static double scalar(double a, double b) { return a - b; }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a, __m256d b) { return _mm256_sub_pd(a, b); }
+				static __m128d sse2_op(__m128d a, __m128d b) { return _mm_sub_pd(a, b); }
+#endif
+			};
+
+			struct MulOp
+			{
+				static const bool avx2 = true, sse2 = true, boolean = false;
+				static double scalar(double a, double b) { return a * b; }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a, __m256d b) { return _mm256_mul_pd(a, b); }
+				static __m128d sse2_op(__m128d a, __m128d b) { return _mm_mul_pd(a, b); }
+#endif
+			};
+
+			struct DivOp
+			{
+				static const bool avx2 = true, sse2 = true, boolean = false;
+				static double scalar(double a, double b) { return a / b; }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a, __m256d b) { return _mm256_div_pd(a, b); }
+				static __m128d sse2_op(__m128d a, __m128d b) { return _mm_div_pd(a, b); }
+#endif
+			};
+
+			// comparisons give 1 or 0 (nan compares false)
+			struct LessOp
+			{
+				static const bool avx2 = true, sse2 = true, boolean = true;
+				static double scalar(double a, double b) { return a < b; }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a, __m256d b) { return _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ), _mm256_set1_pd(1.0)); }
+				static __m128d sse2_op(__m128d a, __m128d b) { return _mm_and_pd(_mm_cmplt_pd(a, b), _mm_set1_pd(1.0)); }
+#endif
+			};
+
+			struct GreaterOp
+			{
+				static const bool avx2 = true, sse2 = true, boolean = true;
+				static double scalar(double a, double b) { return a > b; }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a, __m256d b) { return _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_GT_OQ), _mm256_set1_pd(1.0)); }
+				static __m128d sse2_op(__m128d a, __m128d b) { return _mm_and_pd(_mm_cmpgt_pd(a, b), _mm_set1_pd(1.0)); }
+#endif
+			};
+
+			struct LessEqualOp
+			{
+				static const bool avx2 = true, sse2 = true, boolean = true;
+				static double scalar(double a, double b) { return a <= b; }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a, __m256d b) { return _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ), _mm256_set1_pd(1.0)); }
+				static __m128d sse2_op(__m128d a, __m128d b) { return _mm_and_pd(_mm_cmple_pd(a, b), _mm_set1_pd(1.0)); }
+#endif
+			};
+
+			struct GreaterEqualOp
+			{
+				static const bool avx2 = true, sse2 = true, boolean = true;
+				static double scalar(double a, double b) { return a >= b; }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a, __m256d b) { return _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_GE_OQ), _mm256_set1_pd(1.0)); }
+				static __m128d sse2_op(__m128d a, __m128d b) { return _mm_and_pd(_mm_cmpge_pd(a, b), _mm_set1_pd(1.0)); }
+#endif
+			};
+
+			struct SqrtOp
+			{
+				static const bool avx2 = true, sse2 = true, boolean = false;
+				static double scalar(double a) { return std::sqrt(a); }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a) { return _mm256_sqrt_pd(a); }
+				static __m128d sse2_op(__m128d a) { return _mm_sqrt_pd(a); }
+#endif
+			};
+
+			struct AbsOp
+			{
+				static const bool avx2 = true, sse2 = true, boolean = false;
+				static double scalar(double a) { return std::fabs(a); }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+				static __m128d sse2_op(__m128d a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+#endif
+			};
+
+			// rounding needs SSE4.1, so there is no SSE2 version
+			struct FloorOp
+			{
+				static const bool avx2 = true, sse2 = false, boolean = false;
+				static double scalar(double a) { return std::floor(a); }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a) { return _mm256_floor_pd(a); }
+#endif
+			};
+
+			struct CeilOp
+			{
+				static const bool avx2 = true, sse2 = false, boolean = false;
+				static double scalar(double a) { return std::ceil(a); }
+#ifdef ELI_X86_KERNELS
+				ELI_AVX2 static __m256d avx2_op(__m256d a) { return _mm256_ceil_pd(a); }
+#endif
+			};
+
+			// Operations without vector versions
+#define SCALAR_UNARY_OP(name, is_boolean, expr) struct name\
+			{\
+				static const bool avx2 = false, sse2 = false, boolean = is_boolean;\
+				static double scalar(double a) { return expr; }\
+			};
+
+#define SCALAR_BINARY_OP(name, is_boolean, expr) struct name\
+			{\
+				static const bool avx2 = false, sse2 = false, boolean = is_boolean;\
+				static double scalar(double a, double b) { return expr; }\
+			};
+
+			SCALAR_UNARY_OP(SinOp, false, (double)std::sin((long double)a))
+			SCALAR_UNARY_OP(CosOp, false, (double)std::cos((long double)a))
+			SCALAR_UNARY_OP(TanOp, false, (double)std::tan((long double)a))
+			SCALAR_UNARY_OP(AsinOp, false, (double)std::asin((long double)a))
+			SCALAR_UNARY_OP(AcosOp, false, (double)std::acos((long double)a))
+			SCALAR_UNARY_OP(AtanOp, false, (double)std::atan((long double)a))
+			SCALAR_UNARY_OP(NotOp, true, a == 0.0)
+			SCALAR_BINARY_OP(ModOp, false, std::fmod(a, b))
+			SCALAR_BINARY_OP(EqualOp, true, numbers_equal(a, b))
+			SCALAR_BINARY_OP(NotEqualOp, true, !numbers_equal(a, b))
+			SCALAR_BINARY_OP(AndOp, true, a != 0.0 && b != 0.0)
+			SCALAR_BINARY_OP(OrOp, true, a != 0.0 || b != 0.0)
+			SCALAR_BINARY_OP(XorOp, true, (a != 0.0) != (b != 0.0))
+			SCALAR_BINARY_OP(Atan2Op, false, std::atan2(a, b))
+			SCALAR_BINARY_OP(PowOp, false, std::pow(b, a))
+			SCALAR_BINARY_OP(LogOp, false, std::log(b) / std::log(a))
+
+			// Comparisons and arithmetic look at the numbers only, the others (=, !=, boolean operations) at the atoms
+			template<typename Op>
+			struct ByNumber { static const bool value = !Op::boolean; };
+			template<> struct ByNumber<LessOp> { static const bool value = true; };
+			template<> struct ByNumber<GreaterOp> { static const bool value = true; };
+			template<> struct ByNumber<LessEqualOp> { static const bool value = true; };
+			template<> struct ByNumber<GreaterEqualOp> { static const bool value = true; };
+
+			// Exact versions of the operations on whole numbers
+			using IntegerFn = bool (*)(long long a, long long b, long long& result);
+			template<typename Op>
+			struct Integer { static constexpr IntegerFn op = nullptr; };
+			template<> struct Integer<AddOp> { static constexpr IntegerFn op = add_integers; };
+			template<> struct Integer<SubOp> { static constexpr IntegerFn op = sub_integers; };
+			template<> struct Integer<MulOp> { static constexpr IntegerFn op = mul_integers; };
+			template<> struct Integer<DivOp> { static constexpr IntegerFn op = div_integers; };
+			template<> struct Integer<ModOp> { static constexpr IntegerFn op = mod_integers; };
+			template<> struct Integer<LessOp> { static constexpr IntegerFn op = less_integers; };
+			template<> struct Integer<GreaterOp> { static constexpr IntegerFn op = greater_integers; };
+			template<> struct Integer<LessEqualOp> { static constexpr IntegerFn op = less_equal_integers; };
+			template<> struct Integer<GreaterEqualOp> { static constexpr IntegerFn op = greater_equal_integers; };
+			template<> struct Integer<EqualOp> { static constexpr IntegerFn op = equal_integers; };
+			template<> struct Integer<NotEqualOp> { static constexpr IntegerFn op = not_equal_integers; };
+
+			// Fold whole numbers exactly (false if one of them is not whole or the result does not fit)
+			static bool fold_integers(IntegerFn op, long long accum, const double* a, size_t count, bool right, long long& result)
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					auto d = a[right ? count - 1 - i : i];
+					if (!whole_number(d)) return false;
+
+					auto x = (long long)d;
+					if (!(right ? op(x, accum, accum) : op(accum, x, accum))) return false;
+				}
+
+				result = accum;
+				return true;
+			}
+
+			template<typename Op>
+			static double fold_left(double accum, const double* a, size_t count)
+			{
+				for (size_t i = 0; i < count; i++) accum = Op::scalar(accum, a[i]);
+				return accum;
+			}
+
+			template<typename Op>
+			static double fold_right(double accum, const double* a, size_t count)
+			{
+				for (size_t i = count; i > 0; i--) accum = Op::scalar(a[i - 1], accum);
+				return accum;
+			}
+
+			template<typename Op>
+			static void unary_scalar(const double* a, double* result, size_t count)
+			{
+				for (size_t i = 0; i < count; i++) result[i] = Op::scalar(a[i]);
+			}
+
+			template<typename Op>
+			static void binary_scalar(const double* a, const double* b, double* result, size_t count)
+			{
+				for (size_t i = 0; i < count; i++) result[i] = Op::scalar(a[i], b[i]);
+			}
+
+#ifdef ELI_X86_KERNELS
+			template<typename Op>
+			ELI_AVX2 static void unary_avx2(const double* a, double* result, size_t count)
+			{
+				size_t i = 0;
+				for (; i + 4 <= count; i += 4) _mm256_storeu_pd(result + i, Op::avx2_op(_mm256_loadu_pd(a + i)));
+				for (; i < count; i++) result[i] = Op::scalar(a[i]);
+			}
+
+			template<typename Op>
+			ELI_AVX2 static void binary_avx2(const double* a, const double* b, double* result, size_t count)
+			{
+				size_t i = 0;
+				for (; i + 4 <= count; i += 4) _mm256_storeu_pd(result + i, Op::avx2_op(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+				for (; i < count; i++) result[i] = Op::scalar(a[i], b[i]);
+			}
+
+			template<typename Op>
+			static void unary_sse2(const double* a, double* result, size_t count)
+			{
+				size_t i = 0;
+				for (; i + 2 <= count; i += 2) _mm_storeu_pd(result + i, Op::sse2_op(_mm_loadu_pd(a + i)));
+				for (; i < count; i++) result[i] = Op::scalar(a[i]);
+			}
+
+			template<typename Op>
+			static void binary_sse2(const double* a, const double* b, double* result, size_t count)
+			{
+				size_t i = 0;
+				for (; i + 2 <= count; i += 2) _mm_storeu_pd(result + i, Op::sse2_op(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+				for (; i < count; i++) result[i] = Op::scalar(a[i], b[i]);
+			}
+
+			static bool cpu_has_avx2()
+			{
+				static const bool has = [] { __builtin_cpu_init(); return __builtin_cpu_supports("avx2") != 0; }();
+				return has;
+			}
+#endif
+
+			// The best version of a kernel for this processor
+			template<typename Op>
+			static const ELI::Kernel* unary_kernel()
+			{
+				static const ELI::Kernel kernel = [] {
+					ELI::Kernel k{ unary_scalar<Op>, nullptr, nullptr, nullptr, nullptr, Op::boolean, ByNumber<Op>::value };
+#ifdef ELI_X86_KERNELS
+					if constexpr (Op::sse2) k.unary = unary_sse2<Op>;
+					if constexpr (Op::avx2) if (cpu_has_avx2()) k.unary = unary_avx2<Op>;
+#endif
+					return k;
+				}();
+				return &kernel;
+			}
+
+			template<typename Op>
+			static const ELI::Kernel* binary_kernel()
+			{
+				static const ELI::Kernel kernel = [] {
+					ELI::Kernel k{ nullptr, binary_scalar<Op>, nullptr, nullptr, Integer<Op>::op, Op::boolean, ByNumber<Op>::value };
+					if constexpr (!Op::boolean)
+					{
+						k.fold_left = fold_left<Op>;
+						k.fold_right = fold_right<Op>;
+					}
+#ifdef ELI_X86_KERNELS
+					if constexpr (Op::sse2) k.binary = binary_sse2<Op>;
+					if constexpr (Op::avx2) if (cpu_has_avx2()) k.binary = binary_avx2<Op>;
+#endif
+					return k;
+				}();
+				return &kernel;
+			}
+
+			// Numbers of a packed vector or a list of numbers (not `valid` if the list holds anything else)
+			struct Numbers
+			{
+				std::vector<double> copy;
+				const double* data;
+				size_t size;
+				bool valid;
+
+				Numbers(ELI::NodePtr node) : data{ nullptr }, size{ 0 }, valid{ false }
+				{
+					// a lazy sequence only if making it calls no functions
+					if (auto s = node->seq())
+					{
+						if (!s->forced && !s->is_plain()) return;
+						node = s->force();
+					}
+
+					if (auto v = node->vector())
+					{
+						data = v->begin();
+						size = v->size();
+						valid = true;
+					}
+					else if (append_numbers(copy, node))
+					{
+						data = copy.data();
+						size = copy.size();
+						valid = true;
+					}
+				}
+			};
+
+			// Make the result of a kernel: a vector of numbers or a list of truth values
+			static ELI::NodePtr kernel_result(ELI* eli, const ELI::Kernel* kernel, std::vector<double> numbers)
+			{
+				if (!kernel->boolean) return eli->new_vector(std::move(numbers));
+
+				auto yes = eli->new_atom(true), no = eli->new_atom(false);
+				auto list = eli->new_list();
+				VALUES(list).reserve(numbers.size());
+
+				for (auto d : numbers) VALUES(list).push_back(d != 0.0 ? yes : no);
+
+				return list;
+			}
+
+			// The invocation list of the builtin an Applier is calling: EVAL_ARG takes its arguments as they are
+			static thread_local const ELI::Node* evaluated_call = nullptr;
+
+			// Applies a function to arguments that are already evaluated: a builtin with a kernel runs
+			// it on the numbers, a lambda gets its parameters bound directly and the other builtins
+			// get an invocation list holding the values, which they take without evaluating them
+			struct ELI::Applier
+			{
+				ELI* eli;
+				NodePtr fn;
+				Env scope;
+				const Kernel* kernel;
+				Func* func;
+				Builtin* builtin;
+				NodePtr invocation;
+				NodePtr yes, no;
+
+				Applier(ELI* e, const NodePtr& f, const Env& s, size_t arity) : eli{ e }, fn{ f }, scope{ s }, kernel{ e->find_kernel(f) }, func{ f->func() }, builtin{ f->builtin() }
+				{
+					// a lambda with more parameters fails the way its call does
+					if (func && func->parameter_names.size() > arity) func = nullptr;
+
+					if (kernel && kernel->boolean)
+					{
+						yes = eli->new_atom(true);
+						no = eli->new_atom(false);
+					}
+
+					if (!func)
+					{
+						invocation = eli->new_list();
+						VALUES(invocation).push_back(fn);
+						for (size_t i = 0; i < arity; i++) VALUES(invocation).push_back(eli->new_atom(""));
+					}
+				}
+
+				// Call the builtin (or fail the way the call of anything else does) with the invocation list
+				NodePtr call()
+				{
+					if (!builtin) return eli->eval(invocation, scope);
+
+					struct Restore
+					{
+						const Node* saved;
+						~Restore() { evaluated_call = saved; }
+					} restore{ evaluated_call };
+
+					evaluated_call = invocation.get();
+					return builtin->fn(invocation, scope, eli);
+				}
+
+				// Get the number of an argument if the kernel can take it
+				bool number(const NodePtr& x, double& d) const
+				{
+					auto a = x->atom();
+					if (!a || !(kernel->by_number || (a->numeric && !a->textual))) return false;
+					// the double of a larger whole number is not exact
+					if (a->integral && !exact_in_double(a->integer)) return false;
+
+					d = a->number;
+					return true;
+				}
+
+				// Get the whole numbers of two arguments if the kernel can take them
+				bool whole_numbers(const NodePtr& x, const NodePtr& y, long long& a, long long& b) const
+				{
+					if (!kernel->integer || !integers(x, y, a, b)) return false;
+					return kernel->by_number || (!x->atom()->textual && !y->atom()->textual);
+				}
+
+				NodePtr result(double r)
+				{
+					if (kernel->boolean) return r != 0.0 ? yes : no;
+					return eli->new_atom(r);
+				}
+
+				NodePtr result(long long r)
+				{
+					if (kernel->boolean) return r != 0 ? yes : no;
+					return eli->new_atom(r);
+				}
+
+				// Fold numbers with the kernel, exactly while they are whole
+				NodePtr fold_left(double accum, const double* a, size_t count)
+				{
+					long long r;
+					if (kernel->integer && whole_number(accum) && fold_integers(kernel->integer, (long long)accum, a, count, false, r)) return result(r);
+					return result(kernel->fold_left(accum, a, count));
+				}
+
+				NodePtr fold_right(double accum, const double* a, size_t count)
+				{
+					long long r;
+					if (kernel->integer && whole_number(accum) && fold_integers(kernel->integer, (long long)accum, a, count, true, r)) return result(r);
+					return result(kernel->fold_right(accum, a, count));
+				}
+
+				NodePtr operator()(const NodePtr& x)
+				{
+					double a, r;
+					if (kernel && kernel->unary && number(x, a))
+					{
+						kernel->unary(&a, &r, 1);
+						return result(r);
+					}
+
+					if (func) return func->apply(&x, scope, eli);
+
+					VALUES(invocation).set(1, x);
+					return call();
+				}
+
+				NodePtr operator()(const NodePtr& x, const NodePtr& y)
+				{
+					long long i, j, k;
+					if (kernel && whole_numbers(x, y, i, j) && kernel->integer(i, j, k)) return result(k);
+
+					double a, b, r;
+					if (kernel && kernel->binary && number(x, a) && number(y, b))
+					{
+						kernel->binary(&a, &b, &r, 1);
+						return result(r);
+					}
+
+					if (func)
+					{
+						const NodePtr args[] = { x, y };
+						return func->apply(args, scope, eli);
+					}
+
+					VALUES(invocation).set(1, x);
+					VALUES(invocation).set(2, y);
+					return call();
+				}
+			};
+
+			// The call whose sequence may stay lazy: a sequence function called as the sequence argument
+			// of a function that pulls the elements (another stage, a fold, `head`) is fused with it,
+			// anywhere else its elements are made at once
+			static thread_local const ELI::Node* lazy_argument = nullptr;
+
+			// Evaluate the sequence argument of a function that pulls the elements one at a time
+			static ELI::NodePtr eval_lazy(ELI* eli, const ELI::NodePtr& arg, const ELI::Env& sym)
+			{
+				struct Restore
+				{
+					const ELI::Node* saved;
+					~Restore() { lazy_argument = saved; }
+				} restore{ lazy_argument };
+
+				lazy_argument = arg.get();
+				return eli->eval(arg, sym);
+			}
+
+			// The result of a sequence function: lazy only where the caller pulls the elements
+			static ELI::NodePtr sequence_result(const ELI::NodePtr& tree, ELI::NodePtr result)
+			{
+				auto s = result->seq();
+				if (!s || lazy_argument == tree.get()) return result;
+
+				return s->force();
+			}
+
+			// The elements of a lazy source go through the stages one at a time when the caller pulls them,
+			// so a kernel that would make all of them at once is not used
+			static bool pulled(const ELI::NodePtr& tree, const ELI::NodePtr& source)
+			{
+				auto s = source->seq();
+				return s && !s->forced && lazy_argument == tree.get();
+			}
+
+			// A lazy sequence of the elements of a list passed through one more stage
+			static ELI::NodePtr with_stage(ELI* eli, const ELI::NodePtr& node, ELI::Seq::Stage stage)
+			{
+				auto result = eli->new_seq();
+				auto seq = result->seq();
+				auto source = node->seq();
+
+				if (source && !source->forced)
+				{
+					// the stages fuse into one pipeline over the same source
+					seq->values = source->values;
+					seq->other = source->other;
+					seq->zip = source->zip;
+					seq->zip_scope = source->zip_scope;
+					seq->count = source->count;
+					seq->stages = source->stages;
+				}
+				else
+				{
+					seq->values = source ? source->forced : node;
+				}
+
+				// consecutive Drops (and Takes) are one stage
+				auto& stages = seq->stages;
+				if (!stages.empty() && stages.back().op == stage.op && !stage.fn)
+				{
+					auto& last = stages.back().count;
+					if (stage.op == ELI::Seq::Stage::Op::Drop) last = stage.count < SIZE_MAX - last ? last + stage.count : SIZE_MAX;
+					else last = std::min(last, stage.count);
+					return result;
+				}
+
+				stages.push_back(std::move(stage));
+				return result;
+			}
+
+			class ELI::Seq::Cursor
+			{
+				ELI* eli;
+				Seq* seq;
+				// a list or a vector read directly (`seq` is null)
+				NodePtr node;
+				// the next element of `node` or of the numbers source
+				size_t index;
+				// the sources of a zip, or the source of a sequence with `values`
+				std::unique_ptr<Cursor> left, right;
+				// counters of Take and Drop, DropWhile is still dropping while its state is 1
+				std::vector<size_t> state;
+				std::vector<std::unique_ptr<Applier>> apply;
+				std::unique_ptr<Applier> zip;
+				bool done;
+
+			public:
+				Cursor(ELI* e, const NodePtr& from) : eli{ e }, seq{ from->seq() }, index{ 0 }, done{ false }
+				{
+					if (seq && seq->forced) seq = nullptr;
+
+					if (!seq)
+					{
+						auto s = from->seq();
+						node = s ? s->forced : from;
+						return;
+					}
+
+					if (seq->zip)
+					{
+						left.reset(new Cursor(eli, seq->values));
+						right.reset(new Cursor(eli, seq->other));
+						zip.reset(new Applier(eli, seq->zip, seq->zip_scope, 2));
+					}
+					else if (seq->values)
+					{
+						left.reset(new Cursor(eli, seq->values));
+					}
+
+					for (auto& stage : seq->stages)
+					{
+						state.push_back(stage.op == Stage::Op::DropWhile ? 1 : stage.count);
+						apply.emplace_back(stage.fn ? new Applier(eli, stage.fn, stage.scope, 1) : nullptr);
+					}
+				}
+
+				// Get the next element (false at the end)
+				bool next(NodePtr& out)
+				{
+					if (!seq)
+					{
+						if (auto v = node->vector())
+						{
+							if (index >= v->size()) return false;
+							out = eli->new_atom((*v)[index++]);
+							return true;
+						}
+
+						if (index >= VALUES(node).size()) return false;
+						out = VALUES(node)[index++];
+						return true;
+					}
+
+					while (!done)
+					{
+						// nothing gets past a Take that is used up, the source is not pulled any more
+						for (size_t i = 0; i < state.size(); i++)
+							if (seq->stages[i].op == Stage::Op::Take && state[i] == 0) done = true;
+
+						if (done) break;
+
+						if (zip)
+						{
+							NodePtr x, y;
+							if (!left->next(x) || !right->next(y))
+							{
+								done = true;
+								break;
+							}
+
+							out = (*zip)(x, y);
+						}
+						else if (left)
+						{
+							if (!left->next(out))
+							{
+								done = true;
+								break;
+							}
+						}
+						else
+						{
+							if (index >= seq->count)
+							{
+								done = true;
+								break;
+							}
+
+							out = eli->new_atom((double)index++);
+						}
+
+						auto pass = true;
+
+						for (size_t i = 0; pass && i < state.size(); i++)
+						{
+							switch (seq->stages[i].op)
+							{
+							case Stage::Op::Map:
+								out = (*apply[i])(out);
+								break;
+
+							case Stage::Op::Filter:
+								pass = (bool)*(*apply[i])(out);
+								break;
+
+							case Stage::Op::TakeWhile:
+								if (!(bool)*(*apply[i])(out))
+								{
+									done = true;
+									return false;
+								}
+								break;
+
+							case Stage::Op::DropWhile:
+								if (state[i])
+								{
+									if ((bool)*(*apply[i])(out)) pass = false;
+									else state[i] = 0;
+								}
+								break;
+
+							case Stage::Op::Take:
+								state[i]--;
+								break;
+
+							case Stage::Op::Drop:
+								if (state[i])
+								{
+									state[i]--;
+									pass = false;
+								}
+								break;
+							}
+						}
+
+						if (pass) return true;
+					}
+
+					return false;
+				}
+			};
+
+			bool ELI::Seq::is_plain() const
+			{
+				if (zip) return false;
+
+				for (auto& stage : stages)
+					if (stage.op != Stage::Op::Take && stage.op != Stage::Op::Drop) return false;
+
+				return true;
+			}
+
+			const ELI::NodePtr& ELI::Seq::force()
+			{
+				if (forced) return forced;
+
+				if (is_plain())
+				{
+					// only a window of the source remains
+					auto v = values ? values->vector() : nullptr;
+					size_t from = 0, to = !values ? count : v ? v->size() : values->list()->values.size();
+
+					for (auto& stage : stages)
+					{
+						if (stage.op == Stage::Op::Drop) from = stage.count < to - from ? from + stage.count : to;
+						else if (stage.count < to - from) to = from + stage.count;
+					}
+
+					if (v)
+						forced = eli->new_vector(*v, from, to);
+					else if (values)
+					{
+						forced = eli->new_list();
+						VALUES(forced) = values->list()->values.slice(from, to);
+					}
+					else
+					{
+						std::vector<double> numbers;
+						numbers.reserve(to - from);
+						for (auto i = from; i < to; i++) numbers.push_back((double)i);
+						forced = eli->new_vector(std::move(numbers));
+					}
+
+					release_source();
+					return forced;
+				}
+
+				auto list = eli->new_list();
+				Cursor cursor(eli, NodePtr(this));
+				NodePtr element;
+
+				while (cursor.next(element)) VALUES(list).push_back(element);
+
+				forced = list;
+				release_source();
+				return forced;
+			}
+
+			// Drop the source and the stages, they are not needed once the elements are made
+			void ELI::Seq::release_source()
+			{
+				values.reset();
+				other.reset();
+				zip.reset();
+				zip_scope.reset();
+				stages.clear();
+			}
+
+			// The functions that pull the elements never ask, so the elements are made once here
+			bool ELI::Seq::is_empty()
+			{
+				return force()->is_empty();
+			}
+
+			// Get the kernel of a builtin node
+			const ELI::Kernel* ELI::find_kernel(const NodePtr& fn)
+			{
+				auto b = fn->builtin();
+				if (!b) return nullptr;
+
+				auto k = kernels.find(b->fn);
+				return k != kernels.end() ? k->second : nullptr;
+			}
+
+			// Order of two values: numbers (by value, nan last) before text, atoms before lists,
+			// lists element by element; functions and dictionaries have no order
+			int ELI::order(Node* a, Node* b)
+			{
+				auto x = a->atom(), y = b->atom();
+
+				if (x && y)
+				{
+					if (x->numeric && y->numeric)
+					{
+						if (x->integral && y->integral) return x->integer < y->integer ? -1 : x->integer > y->integer;
+
+						auto p = std::isnan(x->number), q = std::isnan(y->number);
+						if (p || q) return (int)p - (int)q;
+
+						return x->number < y->number ? -1 : x->number > y->number;
+					}
+
+					if (x->numeric != y->numeric) return x->numeric ? -1 : 1;
+
+					auto c = x->value.compare(y->value);
+					return c < 0 ? -1 : c > 0;
+				}
+
+				if (!a->is_atom() && !a->is_list()) throw Invalid_argument{ NodePtr(a) };
+				if (!b->is_atom() && !b->is_list()) throw Invalid_argument{ NodePtr(b) };
+				if (x) return -1;
+				if (y) return 1;
+
+				NodePtr u(a), v(b);
+				if (auto s = u->seq()) u = s->force();
+				if (auto s = v->seq()) v = s->force();
+				u = unpack(this, u);
+				v = unpack(this, v);
+
+				auto& us = VALUES(u);
+				auto& vs = VALUES(v);
+
+				for (size_t i = 0; i < us.size() && i < vs.size(); i++)
+					if (auto c = order(us[i].get(), vs[i].get())) return c;
+
+				return us.size() < vs.size() ? -1 : us.size() > vs.size();
+			}
+
+			// Sort the positions of the keys by their order
+			void ELI::sort_positions(std::vector<size_t>& positions, const ListValues& keys)
+			{
+				auto less = [&](size_t i, size_t j) { return order(keys[i].get(), keys[j].get()) < 0; };
+
+				// other threads may only read atoms: comparing lists touches their reference counts
+				auto atoms = std::all_of(keys.begin(), keys.end(), [](const NodePtr& k) { return k->is_atom(); });
+
+				if (atoms) parallel_sort(positions.begin(), positions.end(), less);
+				else std::stable_sort(positions.begin(), positions.end(), less);
+			}
+
+			// Order of numbers, nan last
+			static bool number_less(double a, double b)
+			{
+				return a < b || (!std::isnan(a) && std::isnan(b));
+			}
+
+			// Mark the first of every run of equal elements, in the order of the stably sorted positions
+			template<typename Equal>
+			static std::vector<bool> first_of_equal(const std::vector<size_t>& positions, Equal equal)
+			{
+				std::vector<bool> keep(positions.size(), false);
+
+				for (size_t i = 0; i < positions.size(); i++)
+					keep[positions[i]] = i == 0 || !equal(positions[i - 1], positions[i]);
+
+				return keep;
+			}
+
+			// Set the number of elements from which sorting runs on several threads
+			void ELI::set_parallel_sort_threshold(size_t count)
+			{
+				ensure_mutable("set the parallel sort threshold");
+				parallel_sort_threshold = count;
+			}
+
+			// Work-stealing pool: every worker takes the newest task of its own queue and steals the
+			// oldest task of another queue when its own is empty. Threads waiting for their tasks run
+			// tasks too, so work submitted from a task never waits for a free worker.
+			class ELI::ThreadPool
+			{
+				struct Queue
+				{
+					std::mutex mutex;
+					std::deque<std::function<void()>> tasks;
+				};
+
+				std::vector<std::unique_ptr<Queue>> queues;
+				std::vector<std::thread> workers;
+				// tasks in the queues
+				std::atomic<size_t> pending;
+				std::atomic<size_t> next_queue;
+				bool stopping;
+				std::mutex sleep_mutex;
+				std::condition_variable wake;
+
+				// the queue of the worker running on this thread
+				static thread_local ThreadPool* own_pool;
+				static thread_local size_t own_queue;
+
+				bool take(size_t queue, bool newest, std::function<void()>& task)
+				{
+					auto& q = *queues[queue];
+					auto x = std::lock_guard<std::mutex>(q.mutex);
+					if (q.tasks.empty()) return false;
+
+					task = std::move(newest ? q.tasks.back() : q.tasks.front());
+					if (newest) q.tasks.pop_back();
+					else q.tasks.pop_front();
+
+					pending.fetch_sub(1);
+					return true;
+				}
+
+				void work(size_t queue)
+				{
+					own_pool = this;
+					own_queue = queue;
+
+					while (true)
+					{
+						if (run_one()) continue;
+
+						std::unique_lock<std::mutex> lock(sleep_mutex);
+						wake.wait(lock, [this] { return stopping || pending.load() > 0; });
+						if (stopping) return;
+					}
+				}
+
+			public:
+				ThreadPool(size_t threads) : pending{ 0 }, next_queue{ 0 }, stopping{ false }
+				{
+					for (size_t i = 0; i < threads; i++) queues.emplace_back(new Queue());
+					for (size_t i = 0; i < threads; i++) workers.emplace_back([this, i] { work(i); });
+				}
+
+				~ThreadPool()
+				{
+					{
+						auto x = std::lock_guard<std::mutex>(sleep_mutex);
+						stopping = true;
+					}
+					wake.notify_all();
+
+					for (auto& w : workers) w.join();
+				}
+
+				size_t size() const { return workers.size(); }
+
+				// Queue a task: a worker puts it in its own queue, other threads spread the tasks
+				void submit(std::function<void()> task)
+				{
+					auto queue = own_pool == this ? own_queue : next_queue.fetch_add(1) % queues.size();
+
+					{
+						auto x = std::lock_guard<std::mutex>(queues[queue]->mutex);
+						queues[queue]->tasks.push_back(std::move(task));
+						pending.fetch_add(1);
+					}
+
+					// taking the lock orders the wake up after a sleeper's check of `pending`
+					{
+						auto x = std::lock_guard<std::mutex>(sleep_mutex);
+					}
+					wake.notify_one();
+				}
+
+				// Run one queued task (false if there is none)
+				bool run_one()
+				{
+					std::function<void()> task;
+					auto home = own_pool == this ? own_queue : 0;
+
+					if (!(own_pool == this && take(home, true, task)))
+					{
+						auto found = false;
+						for (size_t i = 0; i < queues.size() && !found; i++)
+							found = take((home + i) % queues.size(), false, task);
+
+						if (!found) return false;
+					}
+
+					task();
+					return true;
+				}
+			};
+
+			thread_local ELI::ThreadPool* ELI::ThreadPool::own_pool = nullptr;
+			thread_local size_t ELI::ThreadPool::own_queue = 0;
+
+			// Start or stop the pool of worker threads
+			void ELI::set_thread_pool(size_t threads)
+			{
+				ensure_mutable("change the thread pool");
+				thread_pool.reset();
+				if (threads) thread_pool.reset(new ThreadPool(threads));
+			}
+
+			// Set the number of elements from which the parallel builtins use the pool
+			void ELI::set_parallel_threshold(size_t count)
+			{
+				ensure_mutable("set the parallel threshold");
+				parallel_threshold = count;
+			}
+
+			// Stable sort: the parts are sorted on the pool, then the neighbouring parts are merged
+			// level by level, also on the pool
+			template<typename It, typename Less>
+			void ELI::parallel_sort(It first, It last, Less less)
+			{
+				size_t count = last - first;
+
+				// one part per thread, each of a few thousand elements at least
+				size_t parts = thread_pool && parallel_sort_threshold && count >= parallel_sort_threshold ? std::min(thread_pool->size() + 1, count / 4096) : 1;
+
+				if (parts < 2)
+				{
+					std::stable_sort(first, last, less);
+					return;
+				}
+
+				auto bound = [&](size_t part) { return first + count * part / parts; };
+
+				parallel_for(parts, [&](size_t from, size_t to) {
+					for (auto p = from; p < to; p++) std::stable_sort(bound(p), bound(p + 1), less);
+				});
+
+				for (size_t width = 1; width < parts; width *= 2)
+				{
+					parallel_for((parts + 2 * width - 1) / (2 * width), [&](size_t from, size_t to) {
+						for (auto m = from; m < to; m++)
+						{
+							auto low = 2 * width * m, middle = std::min(low + width, parts), high = std::min(low + 2 * width, parts);
+							if (middle < high) std::inplace_merge(bound(low), bound(middle), bound(high), less);
+						}
+					});
+				}
+			}
+
+			// Wait for the result of an external call. The call may be queued behind the tasks of the
+			// thread waiting for it, so the pool keeps running meanwhile; an exception of the call
+			// is rethrown (run_guarded makes it the error of the run).
+			std::vector<std::string> ELI::await_result(const Pending* pending)
+			{
+				auto& result = pending->result;
+
+				if (thread_pool)
+					while (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+						if (!thread_pool->run_one()) result.wait_for(std::chrono::milliseconds(1));
+
+				return result.get();
+			}
+
+			// Unary math functions of the builtins, also used by the compiled code (see math_functions).
+			// sqrt is computed in double precision like its kernel (rounding the long double result
+			// twice is sometimes off by one bit), the others in long double.
+			static double math_sqrt(double x) { return SqrtOp::scalar(x); }
+			static double math_abs(double x) { return (double)std::abs((long double)x); }
+			static double math_sin(double x) { return (double)std::sin((long double)x); }
+			static double math_cos(double x) { return (double)std::cos((long double)x); }
+			static double math_tan(double x) { return (double)std::tan((long double)x); }
+			static double math_asin(double x) { return (double)std::asin((long double)x); }
+			static double math_acos(double x) { return (double)std::acos((long double)x); }
+			static double math_atan(double x) { return (double)std::atan((long double)x); }
+			static double math_floor(double x) { return (double)std::floor((long double)x); }
+			static double math_ceil(double x) { return (double)std::ceil((long double)x); }
+
+			// Get the interned id of a name atom
+			static ELI::SymbolId name_id(ELI* eli, ELI::NodePtr name)
+			{
+				auto atom = name->atom();
+				return atom->symbol != ELI::no_symbol ? atom->symbol : eli->intern(atom->value);
+			}
+
+			// ELI constructor
+			ELI::ELI() : parallel_sort_threshold{ 100000 }, parallel_threshold{ 1000 }, symbol_ids{ new Symbols() }, globals{ new Globals(true) }, globals_entering{ 0 }, max_depth{ 10000 }, allocator{ pool_allocator }, script_cache_capacity{ 512 }, script_cache_hits{ 0 }, script_cache_misses{ 0 }, contexts{ 0 }
+			{
+				// Language primitives
+#define TAIL_SIGNATURE [](const NodePtr& tree, const Env& sym, ELI* eli, [[maybe_unused]] Env& scope) -> NodePtr
+// the tail form is a static function pointer, the builtin calls it directly
+#define BUILTIN_TAIL(form) BUILTIN_SIGNATURE{\
+					Env scope;\
+					auto next = form(tree, sym, eli, scope);\
+					return eli->eval(next, scope ? scope : sym);\
+				}
+
+				static const TailForm seq_form = TAIL_SIGNATURE{
+					if (VAL_SIZE == 0) return eli->new_atom("");
 
 					for (size_t i = 1; i < VAL_SIZE - 1; i++)
 						EVAL_ARG(i);
 
-					return EVAL_ARG(VAL_SIZE - 1);
-				};
+					return VALUES(tree)[VAL_SIZE - 1];
+				};
+				tail_forms["seq"] = seq_form;
+				builtins["seq"] = BUILTIN_TAIL(seq_form);
+
+				builtins["val"] = BUILTIN_SIGNATURE{
+					auto list = eli->new_list();
+					VALUES(list) = VALUES(tree).slice(1, VAL_SIZE);
+					return list;
+				};
+
+#define BUILTIN_CHECK(chk) BUILTIN_SIGNATURE{\
+					CHECK_ARG_COUNT(2);\
+					auto a0 = EVAL_ARG(1);\
+					return eli->new_atom(a0->chk() ? "1" : "");\
+				}
+
+				builtins["empty"] = BUILTIN_CHECK(is_empty);
+				builtins["atom"] = BUILTIN_CHECK(is_atom);
+				builtins["list"] = BUILTIN_CHECK(is_list);
+				builtins["func"] = BUILTIN_CHECK(is_func);
+
+				static const TailForm if_form = TAIL_SIGNATURE{
+					CHECK_ARG_COUNT(4);
+
+					auto max_count = VAL_SIZE - 1;
+
+					for (size_t i = 1; i < max_count; i += 2)
+					{
+						if ((bool)*EVAL_ARG(i))
+							return VALUES(tree)[i + 1];
+					}
+
+					return VALUES(tree)[max_count];
+				};
+				tail_forms["if"] = if_form;
+				builtins["if"] = BUILTIN_TAIL(if_form);
+
+				builtins["id"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					return EVAL_ARG(1);
+				};
+
+				builtins["head"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto src = EVAL_SEQUENCE_ARG(1);
+					ENSURE_SEQUENCE(src);
+
+					// only the first element of a lazy sequence is made
+					if (auto s = src->seq())
+					{
+						NodePtr first;
+						if (!s->forced && !Seq::Cursor(eli, src).next(first)) throw Invalid_argument{ src };
+						if (first) return first;
+						src = s->forced;
+					}
+
+					ENSURE_NOT_EMPTY(src);
+					if (auto v = src->vector()) return eli->new_atom((*v)[0]);
+					return VALUES(src)[0];
+				};
+
+				builtins["tail"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto src = EVAL_SEQUENCE_ARG(1);
+					ENSURE_SEQUENCE(src);
+					if (src->seq() && !src->seq()->forced) return sequence_result(tree, with_stage(eli, src, Seq::Stage{ Seq::Stage::Op::Drop, nullptr, nullptr, 1 }));
+					ENSURE_STRICT(src);
+					if (src->is_empty()) return eli->new_list();
+					if (auto v = src->vector()) return eli->new_vector(*v, 1, v->size());
+					auto list = eli->new_list();
+					VALUES(list) = VALUES(src).slice(1, VALUES(src).size());
+					return list;
+				};
+
+
+				builtins["cons"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+
+					auto src_list = EVAL_ARG(2);
+
+					ENSURE_LIST(src_list);
+
+					auto list = eli->new_list();
+
+					VALUES(list) = VALUES(src_list);
+
+					VALUES(list).push_front(EVAL_ARG(1));
+
+					return list;
+				};
+
+				builtins["fn"] = BUILTIN_SIGNATURE{
+					auto fn = eli->new_func();
+
+					CHECK_ARG_COUNT(2);
+
+					for (size_t i = 1; i < VAL_SIZE - 1; i++)
+					{
+						// parameter names should be atoms
+						if (!VALUES(tree)[i]->is_atom()) continue;
+
+						fn->func()->parameter_names.push_back(VALUES(tree)[i]->atom()->value);
+						fn->func()->parameters.push_back(name_id(eli, VALUES(tree)[i]));
+						fn->func()->body = VALUES(tree)[VAL_SIZE - 1];
+					}
+
+					return fn;
+				};
+
+				static const TailForm let_form = TAIL_SIGNATURE{
+
+					CHECK_ARG_COUNT(4);
+
+					// the names are bound in a new frame on top of the current scope
+					scope = eli->new_frame(sym);
+
+					for (size_t i = 1; i < VAL_SIZE - 2; i += 2)
+					{
+						// names should only be atoms
+						if (!VALUES(tree)[i]->is_atom()) continue;
+
+						scope->bind(name_id(eli, VALUES(tree)[i]), eli->eval(VALUES(tree)[i + 1], scope));
+					}
+
+					return VALUES(tree)[VAL_SIZE - 1];
+				};
+				tail_forms["let"] = let_form;
+				builtins["let"] = BUILTIN_TAIL(let_form);
+
+				builtins["def"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+
+					for (size_t i = 1; i < VAL_SIZE - 1; i += 2)
+					{
+						// names should only be atoms
+						if (!VALUES(tree)[i]->is_atom()) continue;
+
+						auto id = name_id(eli, VALUES(tree)[i]);
+						if (id == no_symbol) throw Symbol_table_full{ VALUES(tree)[i]->atom()->value };
+
+						eli->define(id, EVAL_ARG(i + 1));
+					}
+
+					return eli->new_atom("");
+				};
+
+				// Operations on atoms
+				builtins["!"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto a0 = EVAL_ARG(1);
+					return eli->new_atom(!(bool)*a0);
+				};
+
+#define BUILTIN_BINARY(expr) BUILTIN_SIGNATURE{\
+					CHECK_ARG_COUNT(3);\
+					auto a0 = EVAL_ARG(1);\
+					auto a1 = EVAL_ARG(2);\
+					return eli->new_atom(expr);\
+				};
+
+				// whole numbers are added, compared, ... exactly while the result fits into 64 bits
+#define BUILTIN_INTEGER(integer, expr) BUILTIN_SIGNATURE{\
+					CHECK_ARG_COUNT(3);\
+					auto a0 = EVAL_ARG(1);\
+					auto a1 = EVAL_ARG(2);\
+					long long x, y, r;\
+					if (integers(a0, a1, x, y) && integer(x, y, r)) return eli->new_atom(r);\
+					return eli->new_atom(expr);\
+				};
+
+#define BUILTIN_COMPARISON(op) BUILTIN_SIGNATURE{\
+					CHECK_ARG_COUNT(3);\
+					auto a0 = EVAL_ARG(1);\
+					auto a1 = EVAL_ARG(2);\
+					long long x, y;\
+					if (integers(a0, a1, x, y)) return eli->new_atom(x op y);\
+					return eli->new_atom((double)*a0 op (double)*a1);\
+				};
+
+				builtins["&"] = BUILTIN_BINARY((bool)*a0 && (bool)*a1);
+				builtins["|"] = BUILTIN_BINARY((bool)*a0 || (bool)*a1);
+				builtins["^"] = BUILTIN_BINARY((((bool)*a0) && !((bool)*a1)) || (!((bool)*a0) && ((bool)*a1)));
+				builtins["+"] = BUILTIN_INTEGER(add_integers, (double)*a0 + (double)*a1);
+				builtins["*"] = BUILTIN_INTEGER(mul_integers, (double)*a0 * (double)*a1);
+				builtins["-"] = BUILTIN_INTEGER(sub_integers, (double)*a0 - (double)*a1);
+				builtins["/"] = BUILTIN_INTEGER(div_integers, (double)*a0 / (double)*a1);
+				builtins["%"] = BUILTIN_INTEGER(mod_integers, std::fmod((double)*a0, (double)*a1));
+				builtins["<"] = BUILTIN_COMPARISON(<);
+				builtins[">"] = BUILTIN_COMPARISON(>);
+				builtins["<="] = BUILTIN_COMPARISON(<=);
+				builtins[">="] = BUILTIN_COMPARISON(>=);
+				builtins["="] = BUILTIN_BINARY(a0->compare(a1));
+				builtins["!="] = BUILTIN_BINARY(!a0->compare(a1));
+
+
+				// Integrations
+				builtins["get"] = BUILTIN_SIGNATURE{
+					// Get value from external variable
+					CHECK_ARG_COUNT(2);
+					ENSURE_ATOM(VALUES(tree)[1]);
+					return eli->get_var(VALUES(tree)[1]->atom()->value.c_str());
+				};
+
+				builtins["set"] = BUILTIN_SIGNATURE{
+					// Set value of external variable
+					CHECK_ARG_COUNT(3);
+					ENSURE_ATOM(VALUES(tree)[1]);
+
+					return eli->set_var
+					(
+						VALUES(tree)[1]->atom()->value.c_str(),
+						EVAL_ARG(2)
+					);
+				};
+
+				builtins["call"] = BUILTIN_SIGNATURE{
+					// Call external function, return its result
+					CHECK_ARG_COUNT(3);
+					ENSURE_ATOM(VALUES(tree)[1]);
+
+					auto funcname = VALUES(tree)[1]->atom()->value;
+					auto funcptr = eli->functions.find(funcname);
+					if (funcptr == eli->functions.end())
+						throw Function_not_found{funcname};
+
+					std::vector<std::string> v;
+
+					auto a1 = EVAL_ARG(2);
+					ENSURE_LIST(a1);
+
+					for (auto param : a1->list()->values)
+					{
+						v.push_back (param->to_string ());
+					}
+
+					return eli->new_list((*(funcptr->second)) (v));
+				};
+
+				builtins["callAsync"] = BUILTIN_SIGNATURE{
+					// Start an external function, return its pending result
+					CHECK_ARG_COUNT(3);
+					ENSURE_ATOM(VALUES(tree)[1]);
+
+					auto funcname = VALUES(tree)[1]->atom()->value;
+
+					std::vector<std::string> v;
+
+					auto a1 = EVAL_ARG(2);
+					ENSURE_LIST(a1);
+
+					for (auto param : a1->list()->values)
+					{
+						v.push_back(param->to_string());
+					}
+
+					auto async = eli->async_functions.find(funcname);
+					if (async != eli->async_functions.end())
+						return eli->new_pending((*(async->second)) (std::move(v)).share());
+
+					auto funcptr = eli->functions.find(funcname);
+					if (funcptr == eli->functions.end())
+						throw Function_not_found{funcname};
+
+					// an ordinary external function runs on the pool (on a thread of its own without one);
+					// the result comes through a promise, so a result nobody awaits is dropped without waiting
+					auto done = std::make_shared<std::promise<std::vector<std::string>>>();
+					auto pending = eli->new_pending(done->get_future().share());
+
+					auto task = [done, f = funcptr->second, v = std::move(v)]() {
+						try
+						{
+							done->set_value(f(v));
+						}
+						catch (...)
+						{
+							done->set_exception(std::current_exception());
+						}
+					};
+
+					if (eli->thread_pool) eli->thread_pool->submit(task);
+					else std::thread(task).detach();
+
+					return pending;
+				};
+
+				builtins["await"] = BUILTIN_SIGNATURE{
+					// Wait for a pending result (other values are returned as they are)
+					CHECK_ARG_COUNT(2);
+					auto a0 = EVAL_ARG(1);
+
+					if (auto p = a0->pending()) return eli->new_list(eli->await_result(p));
+
+					return a0;
+				};
+
+				builtins["awaitAll"] = BUILTIN_SIGNATURE{
+					// Wait for all the pending results of a list
+					CHECK_ARG_COUNT(2);
+					auto a0 = EVAL_ARG(1);
+					ENSURE_LIST(a0);
+
+					auto list = eli->new_list();
+					for (auto& x : VALUES(a0))
+					{
+						if (auto p = x->pending()) VALUES(list).push_back(eli->new_list(eli->await_result(p)));
+						else VALUES(list).push_back(x);
+					}
+
+					return list;
+				};
+
+				// cmath proxy
+
+#define MATH_UNARY(op) BUILTIN_SIGNATURE{\
+					CHECK_ARG_COUNT(2);\
+					auto a0 = EVAL_ARG(1);\
+					ENSURE_ATOM(a0);\
+					return eli->new_atom(math_##op((double)*a0));\
+				}
+
+				builtins["sqrt"] = MATH_UNARY(sqrt);
+				builtins["abs"] = MATH_UNARY(abs);
+				builtins["sin"] = MATH_UNARY(sin);
+				builtins["cos"] = MATH_UNARY(cos);
+				builtins["tan"] = MATH_UNARY(tan);
+				builtins["asin"] = MATH_UNARY(asin);
+				builtins["acos"] = MATH_UNARY(acos);
+				builtins["atan"] = MATH_UNARY(atan);
+				builtins["sinCos"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto a0 = EVAL_ARG(1);
+					ENSURE_ATOM(a0);
+
+					auto v = (double)*a0;
+					auto list = eli->new_list();
+					VALUES(list).push_back(eli->new_atom(std::sin(v)));
+					VALUES(list).push_back(eli->new_atom(std::cos(v)));
+
+					return list;
+				};
+
+				builtins["atan2"] = BUILTIN_BINARY(std::atan2((double)*a0, (double)*a1));
+				builtins["pow"] = BUILTIN_BINARY(std::pow((double)*a1, (double)*a0));
+				builtins["log"] = BUILTIN_BINARY(std::log((double)*a1) / std::log((double)*a0));
+				builtins["floor"] = MATH_UNARY(floor);
+				builtins["ceil"] = MATH_UNARY(ceil);
+
+				// More complex functions aka STDLIB
+				builtins["length"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto a0 = EVAL_ARG(1);
+					if (auto d = a0->dict()) return eli->new_atom((unsigned long long) d->count);
+					ENSURE_STRICT(a0);
+
+					if (auto v = a0->vector()) return eli->new_atom((unsigned long long) v->size());
+					return eli->new_atom((unsigned long long) VALUES(a0).size());
+				};
+
+				builtins["reverse"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto a0 = EVAL_ARG(1);
+					ENSURE_STRICT(a0);
+
+					if (auto v = a0->vector()) return eli->new_vector(std::vector<double>(std::reverse_iterator<const double*>(v->end()), std::reverse_iterator<const double*>(v->begin())));
+
+					auto list = eli->new_list();
+
+					std::reverse_copy(VALUES(a0).begin(), VALUES(a0).end(), std::back_inserter(VALUES(list)));
+					return list;
+				};
+
+				builtins["concat"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					ENSURE_STRICT(a0);
+					ENSURE_STRICT(a1);
+
+					// numbers stay packed unless the other list holds anything else
+					if (a0->vector() || a1->vector())
+					{
+						std::vector<double> numbers;
+						if (append_numbers(numbers, a0) && append_numbers(numbers, a1)) return eli->new_vector(std::move(numbers));
+					}
+
+					ENSURE_LIST(a0);
+					ENSURE_LIST(a1);
+
+					auto list = eli->new_list();
+					VALUES(list) = VALUES(a0);
+					VALUES(list).append(VALUES(a1).begin(), VALUES(a1).end());
+					return list;
+				};
+
+				builtins["iota"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto a0 = EVAL_ARG(1);
+					ENSURE_ATOM(a0);
+
+					// the numbers are made when they are needed
+					auto n = std::ceil((double)*a0);
+					auto result = eli->new_seq();
+					result->seq()->count = n > 0 ? (size_t)n : 0;
+
+					return sequence_result(tree, result);
+				};
+
+				builtins["take"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_SEQUENCE_ARG(2);
+					ENSURE_ATOM(a0);
+					ENSURE_SEQUENCE(a1);
+
+					auto n = (double)*a0;
+
+					if (a1->seq() && !a1->seq()->forced)
+						return sequence_result(tree, with_stage(eli, a1, Seq::Stage{ Seq::Stage::Op::Take, nullptr, nullptr, n <= 0 ? 0 : n >= (double)SIZE_MAX ? SIZE_MAX : (size_t)std::ceil(n) }));
+
+					ENSURE_STRICT(a1);
+
+					if (a1->is_empty()) return a1;
+
+					auto v = a1->vector();
+					auto size = v ? v->size() : VALUES(a1).size();
+					size_t count = 0;
+					if (n > 0) count = n >= size ? size : (size_t)std::ceil(n);
+
+					if (v) return eli->new_vector(*v, 0, count);
+
+					auto list = eli->new_list();
+					VALUES(list) = VALUES(a1).slice(0, count);
+
+					return list;
+				};
+
+				builtins["drop"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_SEQUENCE_ARG(2);
+					ENSURE_ATOM(a0);
+					ENSURE_SEQUENCE(a1);
+
+					auto from = (size_t)(double)*a0;
+
+					if (a1->seq() && !a1->seq()->forced) return sequence_result(tree, with_stage(eli, a1, Seq::Stage{ Seq::Stage::Op::Drop, nullptr, nullptr, from }));
+
+					ENSURE_STRICT(a1);
+
+					if (a1->is_empty()) return a1;
+
+					if (auto v = a1->vector())
+					{
+						if (from < v->size()) return eli->new_vector(*v, from, v->size());
+						return eli->new_list();
+					}
+
+					auto list = eli->new_list();
+
+					if (from < VALUES(a1).size()) VALUES(list) = VALUES(a1).slice(from, VALUES(a1).size());
+
+					return list;
+				};
+
+				builtins["nth"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					ENSURE_ATOM(a0);
+					// the elements are made once and then read directly
+					ENSURE_STRICT(a1);
+
+					auto index = a0->atom();
+					if (!index->integral || index->integer < 0) throw Invalid_argument{ a0 };
+					auto i = (size_t)index->integer;
+
+					if (auto v = a1->vector())
+					{
+						if (i >= v->size()) throw Invalid_argument{ a0 };
+						return eli->new_atom((*v)[i]);
+					}
+
+					if (i >= VALUES(a1).size()) throw Invalid_argument{ a0 };
+					return VALUES(a1)[i];
+				};
+
+				builtins["slice"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(4);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					auto a2 = EVAL_SEQUENCE_ARG(3);
+					ENSURE_ATOM(a0);
+					ENSURE_ATOM(a1);
+					ENSURE_SEQUENCE(a2);
+
+					auto from = (double)*a0 > 0 ? (size_t)(double)*a0 : 0;
+					auto to = (double)*a1 > 0 ? (size_t)std::ceil((double)*a1) : 0;
+					if (to < from) to = from;
+
+					if (a2->seq() && !a2->seq()->forced)
+					{
+						auto dropped = with_stage(eli, a2, Seq::Stage{ Seq::Stage::Op::Drop, nullptr, nullptr, from });
+						return sequence_result(tree, with_stage(eli, dropped, Seq::Stage{ Seq::Stage::Op::Take, nullptr, nullptr, to - from }));
+					}
+
+					ENSURE_STRICT(a2);
+
+					auto v = a2->vector();
+					auto size = v ? v->size() : VALUES(a2).size();
+					if (to > size) to = size;
+					if (from >= to) return eli->new_list();
+
+					if (v) return eli->new_vector(*v, from, to);
+
+					auto list = eli->new_list();
+					VALUES(list) = VALUES(a2).slice(from, to);
+
+					return list;
+				};
+
+				builtins["last"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto src = EVAL_ARG(1);
+					ENSURE_STRICT(src);
+					ENSURE_NOT_EMPTY(src);
+
+					if (auto v = src->vector()) return eli->new_atom((*v)[v->size() - 1]);
+					return VALUES(src).back();
+				};
+
+				builtins["init"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto src = EVAL_ARG(1);
+					ENSURE_STRICT(src);
+					if (src->is_empty()) return eli->new_list();
+					if (auto v = src->vector()) return eli->new_vector(*v, 0, v->size() - 1);
+					auto list = eli->new_list();
+					VALUES(list) = VALUES(src).slice(0, VALUES(src).size() - 1);
+					return list;
+				};
+
+				builtins["map"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_SEQUENCE_ARG(2);
+
+					ENSURE_FUNC(a0);
+					ENSURE_SEQUENCE(a1);
+
+					if (!a1->seq() && a1->is_empty()) return a1;
+
+					// builtins with a kernel go over all the numbers at once
+					auto kernel = pulled(tree, a1) ? nullptr : eli->find_kernel(a0);
+					if (kernel)
+					{
+						Numbers xs(a1);
+
+						if (kernel->unary && xs.valid)
+						{
+							std::vector<double> result(xs.size);
+							kernel->unary(xs.data, result.data(), xs.size);
+							return kernel_result(eli, kernel, std::move(result));
+						}
+					}
+
+					return sequence_result(tree, with_stage(eli, a1, Seq::Stage{ Seq::Stage::Op::Map, a0, sym, 0 }));
+				};
+
+				builtins["filter"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_SEQUENCE_ARG(2);
+
+					ENSURE_FUNC(a0);
+					ENSURE_SEQUENCE(a1);
+
+					if (!a1->seq() && a1->is_empty()) return a1;
+
+					return sequence_result(tree, with_stage(eli, a1, Seq::Stage{ Seq::Stage::Op::Filter, a0, sym, 0 }));
+				};
+
+				builtins["zipWith"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(4);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_SEQUENCE_ARG(2);
+					auto a2 = EVAL_SEQUENCE_ARG(3);
+
+					ENSURE_FUNC(a0);
+					ENSURE_SEQUENCE(a1);
+					ENSURE_SEQUENCE(a2);
+
+					if ((!a1->seq() && a1->is_empty()) || (!a2->seq() && a2->is_empty())) return eli->new_list();
+
+					// builtins with a kernel go over all the numbers at once
+					auto kernel = pulled(tree, a1) || pulled(tree, a2) ? nullptr : eli->find_kernel(a0);
+					if (kernel)
+					{
+						Numbers xs(a1), ys(a2);
+
+						if (kernel->binary && xs.valid && ys.valid)
+						{
+							auto count = std::min(xs.size, ys.size);
+							std::vector<double> result(count);
+							kernel->binary(xs.data, ys.data, result.data(), count);
+							return kernel_result(eli, kernel, std::move(result));
+						}
+					}
+
+					auto result = eli->new_seq();
+					auto seq = result->seq();
+					seq->zip = a0;
+					seq->zip_scope = sym;
+					seq->values = a1;
+					seq->other = a2;
+
+					return sequence_result(tree, result);
+				};
+
+				builtins["takeWhile"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_SEQUENCE_ARG(2);
+					ENSURE_FUNC(a0);
+					ENSURE_SEQUENCE(a1);
+
+					if (!a1->seq() && a1->is_empty()) return a1;
+
+					return sequence_result(tree, with_stage(eli, a1, Seq::Stage{ Seq::Stage::Op::TakeWhile, a0, sym, 0 }));
+				};
+
+				builtins["dropWhile"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_SEQUENCE_ARG(2);
+					ENSURE_FUNC(a0);
+					ENSURE_SEQUENCE(a1);
+
+					if (!a1->seq() && a1->is_empty()) return a1;
+
+					return sequence_result(tree, with_stage(eli, a1, Seq::Stage{ Seq::Stage::Op::DropWhile, a0, sym, 0 }));
+				};
+
+				builtins["repeat"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					ENSURE_ATOM(a0);
+
+					auto count = (size_t)(double)*a0;
+
+					if (packable(a1)) return eli->new_vector(std::vector<double>(count, a1->atom()->number));
+
+					auto list = eli->new_list();
+
+					while (count--)
+					{
+						VALUES(list).push_back(a1);
+					}
+
+					return list;
+				};
+
+				// Dictionaries
+
+				builtins["dict"] = BUILTIN_SIGNATURE{
+					if (VAL_SIZE % 2 == 0) throw Insufficient_arguments{ tree };
+
+					auto result = eli->new_dict();
+
+					for (size_t i = 1; i < VAL_SIZE; i += 2)
+					{
+						auto key = EVAL_ARG(i);
+						ENSURE_ATOM(key);
+						result->dict()->insert(key, EVAL_ARG(i + 1));
+					}
+
+					return result;
+				};
+
+				builtins["lookup"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					ENSURE_DICT(a0);
+					ENSURE_ATOM(a1);
+
+					if (auto found = a0->dict()->find(a1->to_string())) return *found;
+
+					// the default value is evaluated only when the key is missing
+					return VAL_SIZE > 3 ? EVAL_ARG(3) : eli->new_atom("");
+				};
+
+				builtins["has"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					ENSURE_DICT(a0);
+					ENSURE_ATOM(a1);
+
+					return eli->new_atom(a0->dict()->find(a1->to_string()) != nullptr);
+				};
+
+				builtins["assoc"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(4);
+					if (VAL_SIZE % 2 == 1) throw Insufficient_arguments{ tree };
+
+					auto a0 = EVAL_ARG(1);
+					ENSURE_DICT(a0);
+
+					auto result = eli->new_dict(*a0->dict());
+
+					for (size_t i = 2; i < VAL_SIZE; i += 2)
+					{
+						auto key = EVAL_ARG(i);
+						ENSURE_ATOM(key);
+						result->dict()->insert(key, EVAL_ARG(i + 1));
+					}
+
+					return result;
+				};
+
+				builtins["dissoc"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					ENSURE_DICT(a0);
+
+					auto result = eli->new_dict(*a0->dict());
+
+					for (size_t i = 2; i < VAL_SIZE; i++)
+					{
+						auto key = EVAL_ARG(i);
+						ENSURE_ATOM(key);
+						result->dict()->remove(key->to_string());
+					}
+
+					return result;
+				};
+
+				builtins["keys"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto a0 = EVAL_ARG(1);
+					ENSURE_DICT(a0);
+
+					auto list = eli->new_list();
+					for (auto& e : a0->dict()->entries()) VALUES(list).push_back(e.first);
+
+					return list;
+				};
+
+				builtins["values"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto a0 = EVAL_ARG(1);
+					ENSURE_DICT(a0);
+
+					auto list = eli->new_list();
+					for (auto& e : a0->dict()->entries()) VALUES(list).push_back(e.second);
+
+					return list;
+				};
+
+				builtins["foldl1"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_SEQUENCE_ARG(2);
+					ENSURE_FUNC(a0);
+					ENSURE_SEQUENCE(a1);
+
+					Applier apply(eli, a0, sym, 2);
+
+					// numbers are folded by the kernel in one loop
+					if (apply.kernel && apply.kernel->fold_left)
+					{
+						Numbers xs(a1);
+						if (xs.valid && xs.size > 1) return apply.fold_left(xs.data[0], xs.data + 1, xs.size - 1);
+					}
+
+					// a lazy sequence is folded as its elements are made
+					if (a1->seq() && !a1->seq()->forced)
+					{
+						Seq::Cursor cursor(eli, a1);
+						NodePtr accum, element;
+
+						if (!cursor.next(accum)) throw Invalid_argument{ a1 };
+
+						while (cursor.next(element)) accum = apply(accum, element);
+
+						return accum;
+					}
+
+					ENSURE_LIST(a1);
+					ENSURE_NOT_EMPTY(a1);
+
+					auto accum = VALUES(a1)[0];
+
+					for (size_t i = 1; i < VALUES(a1).size(); i++)
+						accum = apply(accum, VALUES(a1)[i]);
+
+					return accum;
+				};
+
+				builtins["foldl"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(4);
+					auto a0 = EVAL_ARG(1); // fn
+					auto a1 = EVAL_ARG(2); // accum
+					auto a2 = EVAL_SEQUENCE_ARG(3); // list
+
+					ENSURE_FUNC(a0);
+					ENSURE_SEQUENCE(a2);
+
+					Applier apply(eli, a0, sym, 2);
+
+					// numbers are folded by the kernel in one loop
+					double start;
+					if (apply.kernel && apply.kernel->fold_left && apply.number(a1, start))
+					{
+						Numbers xs(a2);
+						if (xs.valid && xs.size > 0) return apply.fold_left(start, xs.data, xs.size);
+					}
+
+					// a lazy sequence is folded as its elements are made
+					if (a2->seq() && !a2->seq()->forced)
+					{
+						Seq::Cursor cursor(eli, a2);
+						NodePtr accum = a1, element;
+
+						while (cursor.next(element)) accum = apply(accum, element);
+
+						return accum;
+					}
+
+					ENSURE_LIST(a2);
+
+					auto accum = a1;
+
+					for (auto& v : VALUES(a2))
+						accum = apply(accum, v);
+
+					return accum;
+				};
+
+				builtins["foldr"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(4);
+					auto a0 = EVAL_ARG(1); // fn
+					auto a1 = EVAL_ARG(2); // accum
+					auto a2 = EVAL_ARG(3); // list
+
+					ENSURE_FUNC(a0);
+					ENSURE_SEQUENCE(a2);
+
+					Applier apply(eli, a0, sym, 2);
+
+					// numbers are folded by the kernel in one loop
+					double start;
+					if (apply.kernel && apply.kernel->fold_right && apply.number(a1, start))
+					{
+						Numbers xs(a2);
+						if (xs.valid && xs.size > 0) return apply.fold_right(start, xs.data, xs.size);
+					}
+
+					ENSURE_LIST(a2);
+
+					auto accum = a1;
+
+					for (auto i = VALUES(a2).size(); i > 0; i--)
+						accum = apply(VALUES(a2)[i - 1], accum);
+
+					return accum;
+				};
+
+				builtins["foldr1"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1); // fn
+					auto a1 = EVAL_ARG(2); // list
+
+					ENSURE_FUNC(a0);
+					ENSURE_SEQUENCE(a1);
+
+					Applier apply(eli, a0, sym, 2);
+
+					// numbers are folded by the kernel in one loop
+					if (apply.kernel && apply.kernel->fold_right)
+					{
+						Numbers xs(a1);
+						if (xs.valid && xs.size > 1) return apply.fold_right(xs.data[xs.size - 1], xs.data, xs.size - 1);
+					}
+
+					ENSURE_LIST(a1);
+					ENSURE_NOT_EMPTY(a1);
+
+					auto count = VALUES(a1).size();
+					auto accum = VALUES(a1)[count - 1];
+
+					for (auto i = count - 1; i > 0; i--)
+						accum = apply(VALUES(a1)[i - 1], accum);
+
+					return accum;
+				};
+
+				builtins["sort"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto a0 = EVAL_ARG(1);
+					ENSURE_STRICT(a0);
+
+					if (auto v = a0->vector())
+					{
+						std::vector<double> numbers(v->begin(), v->end());
+						eli->parallel_sort(numbers.begin(), numbers.end(), number_less);
+						return eli->new_vector(std::move(numbers));
+					}
+
+					auto& values = VALUES(a0);
+					std::vector<size_t> positions(values.size());
+					for (size_t i = 0; i < positions.size(); i++) positions[i] = i;
+
+					eli->sort_positions(positions, values);
+
+					auto list = eli->new_list();
+					VALUES(list).reserve(positions.size());
+					for (auto i : positions) VALUES(list).push_back(values[i]);
+
+					return list;
+				};
+
+				builtins["sortBy"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					ENSURE_FUNC(a0);
+					ENSURE_STRICT(a1);
+
+					auto kernel = eli->find_kernel(a0);
+					auto func = a0->func();
+
+					// numbers ordered by `<` or `>` are sorted natively
+					auto v = a1->vector();
+					if (v && (kernel == binary_kernel<LessOp>() || kernel == binary_kernel<GreaterOp>()))
+					{
+						std::vector<double> numbers(v->begin(), v->end());
+						if (kernel == binary_kernel<LessOp>())
+							eli->parallel_sort(numbers.begin(), numbers.end(), number_less);
+						else
+							eli->parallel_sort(numbers.begin(), numbers.end(), [](double a, double b) { return number_less(b, a); });
+
+						return eli->new_vector(std::move(numbers));
+					}
+
+					ENSURE_LIST(a1);
+
+					auto& values = VALUES(a1);
+					std::vector<size_t> positions(values.size());
+					for (size_t i = 0; i < positions.size(); i++) positions[i] = i;
+
+					// a comparison (a builtin like `<` or a lambda of two parameters) tells if its first argument goes first
+					if ((kernel && kernel->binary && kernel->boolean) || (func && func->parameter_names.size() == 2))
+					{
+						Applier apply(eli, a0, sym, 2);
+						std::stable_sort(positions.begin(), positions.end(), [&](size_t i, size_t j) { return (bool)*apply(values[i], values[j]); });
+					}
+					else
+					{
+						// otherwise it gives the key of an element, it is called once for every element
+						Applier apply(eli, a0, sym, 1);
+
+						ListValues keys;
+						keys.reserve(values.size());
+						for (auto& x : values) keys.push_back(apply(x));
+
+						eli->sort_positions(positions, keys);
+					}
+
+					auto list = eli->new_list();
+					VALUES(list).reserve(positions.size());
+					for (auto i : positions) VALUES(list).push_back(values[i]);
+
+					return list;
+				};
+
+				builtins["binarySearch"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					ENSURE_STRICT(a1);
+
+					long long found = -1;
+
+					if (a1->vector() && packable(a0))
+					{
+						auto v = a1->vector();
+						auto x = a0->atom()->number;
+						auto it = std::lower_bound(v->begin(), v->end(), x, number_less);
+						if (it != v->end() && !number_less(x, *it)) found = it - v->begin();
+
+						return eli->new_atom(found);
+					}
+
+					ENSURE_LIST(a1);
+
+					auto& values = VALUES(a1);
+					size_t lo = 0, hi = values.size();
+
+					while (lo < hi)
+					{
+						auto mid = lo + (hi - lo) / 2;
+						if (eli->order(values[mid].get(), a0.get()) < 0) lo = mid + 1;
+						else hi = mid;
+					}
+
+					if (lo < values.size() && eli->order(values[lo].get(), a0.get()) == 0) found = lo;
+
+					return eli->new_atom(found);
+				};
+
+				builtins["unique"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(2);
+					auto a0 = EVAL_ARG(1);
+					ENSURE_STRICT(a0);
+
+					auto v = a0->vector();
+					std::vector<size_t> positions(v ? v->size() : VALUES(a0).size());
+					for (size_t i = 0; i < positions.size(); i++) positions[i] = i;
+
+					if (v)
+					{
+						auto less = [v](size_t i, size_t j) { return number_less((*v)[i], (*v)[j]); };
+						eli->parallel_sort(positions.begin(), positions.end(), less);
+						auto keep = first_of_equal(positions, [&](size_t i, size_t j) { return !less(i, j) && !less(j, i); });
+
+						std::vector<double> numbers;
+						for (size_t i = 0; i < keep.size(); i++) if (keep[i]) numbers.push_back((*v)[i]);
+
+						return eli->new_vector(std::move(numbers));
+					}
+
+					auto& values = VALUES(a0);
+					eli->sort_positions(positions, values);
+					auto keep = first_of_equal(positions, [&](size_t i, size_t j) { return eli->order(values[i].get(), values[j].get()) == 0; });
+
+					auto list = eli->new_list();
+					for (size_t i = 0; i < keep.size(); i++) if (keep[i]) VALUES(list).push_back(values[i]);
+
+					return list;
+				};
+
+#define BUILTIN_EXTREME(extreme_element, before) BUILTIN_SIGNATURE{\
+					CHECK_ARG_COUNT(2);\
+					auto a0 = EVAL_ARG(1);\
+					ENSURE_STRICT(a0);\
+					ENSURE_NOT_EMPTY(a0);\
+					if (auto v = a0->vector()) return eli->new_atom(*extreme_element(v->begin(), v->end(), number_less));\
+					auto& values = VALUES(a0);\
+					auto best = values[0];\
+					for (auto& x : values) if (before) best = x;\
+					return best;\
+				};
+
+				builtins["minimum"] = BUILTIN_EXTREME(std::min_element, eli->order(x.get(), best.get()) < 0);
+				builtins["maximum"] = BUILTIN_EXTREME(std::max_element, eli->order(best.get(), x.get()) < 0);
+
+				builtins["partition"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					ENSURE_FUNC(a0);
+					ENSURE_LIST(a1);
+
+					Applier apply(eli, a0, sym, 1);
+					auto yes = eli->new_list(), no = eli->new_list();
+
+					for (auto& x : VALUES(a1))
+					{
+						auto& side = (bool)*apply(x) ? yes : no;
+						VALUES(side).push_back(x);
+					}
+
+					auto result = eli->new_list();
+					VALUES(result).push_back(yes);
+					VALUES(result).push_back(no);
+
+					return result;
+				};
+
+				builtins["pmap"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					ENSURE_FUNC(a0);
+					ENSURE_LIST(a1);
+
+					auto& values = VALUES(a1);
+					std::vector<NodePtr> results(values.size());
+
+					eli->parallel_chunks(a0, sym, 1, a1, values.size(), [&](Applier& apply, size_t from, size_t to) {
+						for (auto i = from; i < to; i++) results[i] = apply(values[i]);
+					});
+
+					auto list = eli->new_list();
+					VALUES(list).reserve(results.size());
+					for (auto& r : results) VALUES(list).push_back(std::move(r));
+
+					return list;
+				};
+
+				builtins["pfilter"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					ENSURE_FUNC(a0);
+					ENSURE_LIST(a1);
+
+					auto& values = VALUES(a1);
+					std::vector<char> pass(values.size());
+
+					eli->parallel_chunks(a0, sym, 1, a1, values.size(), [&](Applier& apply, size_t from, size_t to) {
+						for (auto i = from; i < to; i++) pass[i] = (bool)*apply(values[i]);
+					});
+
+					auto list = eli->new_list();
+					for (size_t i = 0; i < values.size(); i++) if (pass[i]) VALUES(list).push_back(values[i]);
+
+					return list;
+				};
+
+				// the chunks are folded separately, so `f` must be associative
+				builtins["preduce"] = BUILTIN_SIGNATURE{
+					CHECK_ARG_COUNT(3);
+					auto a0 = EVAL_ARG(1);
+					auto a1 = EVAL_ARG(2);
+					ENSURE_FUNC(a0);
+					ENSURE_SEQUENCE(a1);
+
+					// numbers are folded by the kernel in one loop
+					Applier apply(eli, a0, sym, 2);
+					if (apply.kernel && apply.kernel->fold_left)
+					{
+						Numbers xs(a1);
+						if (xs.valid && xs.size > 1) return apply.fold_left(xs.data[0], xs.data + 1, xs.size - 1);
+					}
+
+					ENSURE_LIST(a1);
+					ENSURE_NOT_EMPTY(a1);
+
+					auto& values = VALUES(a1);
+					std::mutex parts_mutex;
+					std::vector<std::pair<size_t, NodePtr>> folded;
+
+					eli->parallel_chunks(a0, sym, 2, a1, values.size(), [&](Applier& apply, size_t from, size_t to) {
+						if (from == to) return;
+
+						auto accum = values[from];
+						for (auto i = from + 1; i < to; i++) accum = apply(accum, values[i]);
+
+						auto x = std::lock_guard<std::mutex>(parts_mutex);
+						folded.emplace_back(from, std::move(accum));
+					});
+
+					// the results of the chunks are combined in order
+					std::sort(folded.begin(), folded.end(), [](const std::pair<size_t, NodePtr>& a, const std::pair<size_t, NodePtr>& b) { return a.first < b.first; });
+
+					auto accum = folded[0].second;
+					for (size_t i = 1; i < folded.size(); i++) accum = apply(accum, folded[i].second);
+
+					return accum;
+				};
+
+				// elementwise kernels for map and zipWith
+				kernels[builtins["+"]] = binary_kernel<AddOp>();
+				kernels[builtins["-"]] = binary_kernel<SubOp>();
+				kernels[builtins["*"]] = binary_kernel<MulOp>();
+				kernels[builtins["/"]] = binary_kernel<DivOp>();
+				kernels[builtins["%"]] = binary_kernel<ModOp>();
+				kernels[builtins["<"]] = binary_kernel<LessOp>();
+				kernels[builtins[">"]] = binary_kernel<GreaterOp>();
+				kernels[builtins["<="]] = binary_kernel<LessEqualOp>();
+				kernels[builtins[">="]] = binary_kernel<GreaterEqualOp>();
+				kernels[builtins["="]] = binary_kernel<EqualOp>();
+				kernels[builtins["!="]] = binary_kernel<NotEqualOp>();
+				kernels[builtins["&"]] = binary_kernel<AndOp>();
+				kernels[builtins["|"]] = binary_kernel<OrOp>();
+				kernels[builtins["^"]] = binary_kernel<XorOp>();
+				kernels[builtins["atan2"]] = binary_kernel<Atan2Op>();
+				kernels[builtins["pow"]] = binary_kernel<PowOp>();
+				kernels[builtins["log"]] = binary_kernel<LogOp>();
+				kernels[builtins["!"]] = unary_kernel<NotOp>();
+				kernels[builtins["sqrt"]] = unary_kernel<SqrtOp>();
+				kernels[builtins["abs"]] = unary_kernel<AbsOp>();
+				kernels[builtins["floor"]] = unary_kernel<FloorOp>();
+				kernels[builtins["ceil"]] = unary_kernel<CeilOp>();
+				kernels[builtins["sin"]] = unary_kernel<SinOp>();
+				kernels[builtins["cos"]] = unary_kernel<CosOp>();
+				kernels[builtins["tan"]] = unary_kernel<TanOp>();
+				kernels[builtins["asin"]] = unary_kernel<AsinOp>();
+				kernels[builtins["acos"]] = unary_kernel<AcosOp>();
+				kernels[builtins["atan"]] = unary_kernel<AtanOp>();
+
+				// flat table of the builtins for the run-time lookup
+				for (auto& b : builtins)
+				{
+					auto id = intern(b.first);
+					if (id >= builtin_table.size())
+					{
+						builtin_table.resize(id + 1, nullptr);
+						builtin_nodes.resize(id + 1);
+					}
+					builtin_table[id] = b.second;
+					auto tail = tail_forms.find(b.first);
+					builtin_nodes[id] = make_node<Builtin>(b.first, b.second, tail != tail_forms.end() ? tail->second : nullptr);
+					builtin_nodes[id]->share();
+				}
+			}
+
+			// Store a global value
+			// A run holds one version of the globals from its start to its end (with its own definitions
+			// added to it); nested runs and lookups on the same thread read the version of the outermost one
+			class ELI::GlobalsLease
+			{
+				static thread_local GlobalsLease* innermost;
+
+				ELI* eli;
+				GlobalsLease* outer;
+				// the lease holding the version for this interpreter
+				GlobalsLease* owner;
+				// the allocator of the context running before this one
+				const ELI* saved_image;
+				Allocator saved_allocator;
+
+			public:
+				Globals* held;
+				// `def` changes only the held version (the runs of a context and their workers)
+				bool isolated;
+				// the context running on this thread
+				Context* context;
+
+				GlobalsLease(ELI* e) : eli{ e }, outer{ innermost }, owner{ this }, held{ nullptr }, isolated{ false }, context{ nullptr }
+				{
+					for (auto l = innermost; l; l = l->outer)
+						if (l->eli == e && l->owner == l)
+						{
+							owner = l;
+							return;
+						}
+
+					held = eli->acquire_globals();
+					innermost = this;
+				}
+
+				// Hold a version another lease holds (a worker running a part of that lease's run)
+				GlobalsLease(ELI* e, Globals* g, bool i) : eli{ e }, outer{ innermost }, owner{ this }, held{ g }, isolated{ i }, context{ nullptr }
+				{
+					held->readers.fetch_add(1);
+					innermost = this;
+				}
+
+				// Hold the version of a context for one of its runs
+				GlobalsLease(Context* c) : eli{ c->image }, outer{ innermost }, owner{ this }, held{ nullptr }, isolated{ true }, context{ c }
+				{
+					for (auto l = innermost; l; l = l->outer)
+						if (l->context == c && l->owner == l)
+						{
+							owner = l;
+							return;
+						}
+
+					// the context gives its reference to the lease until the run ends
+					held = c->overlay;
+					innermost = this;
+
+					saved_image = context_image;
+					saved_allocator = context_allocator;
+					context_image = eli;
+					context_allocator = c->allocator;
+				}
+
+				~GlobalsLease()
+				{
+					if (owner != this) return;
+
+					innermost = outer;
+
+					if (context)
+					{
+						context->overlay = held;
+						context_image = saved_image;
+						context_allocator = saved_allocator;
+					}
+					else eli->release_globals(held);
+				}
+
+				Globals* globals() const { return owner->held; }
+
+				// The lease holding the version for the interpreter on this thread (nullptr if there is none)
+				static GlobalsLease* held_by(ELI* e)
+				{
+					for (auto l = innermost; l; l = l->outer)
+						if (l->eli == e && l->owner == l) return l;
+
+					return nullptr;
+				}
+			};
+
+			thread_local ELI::GlobalsLease* ELI::GlobalsLease::innermost = nullptr;
+
+			// Take a reference to the current version of the globals
+			ELI::Globals* ELI::acquire_globals()
+			{
+				// a `def` does not free the version loaded here until the reader is counted in
+				globals_entering.fetch_add(1);
+				auto g = globals.load();
+				g->readers.fetch_add(1);
+				globals_entering.fetch_sub(1);
+
+				return g;
+			}
+
+			void ELI::release_globals(Globals* g)
+			{
+				// once the count is down a `def` on another thread may free a published version
+				auto published = g->published;
+				if (g->readers.fetch_sub(1) != 1) return;
+
+				if (!published)
+				{
+					delete g;
+					return;
+				}
+
+				if (g == globals.load()) return;
+
+				// the last reader of a replaced version frees it unless a `def` is running (that one will)
+				if (symbol_mutex.try_lock())
+				{
+					reclaim_globals();
+					symbol_mutex.unlock();
+				}
+			}
+
+			void ELI::reclaim_globals()
+			{
+				// a reader may have loaded a replaced version and not counted itself in yet
+				if (globals_entering.load() != 0) return;
+
+				auto unread = std::remove_if(retired_globals.begin(), retired_globals.end(), [](Globals* g) {
+					if (g->readers.load() != 0) return false;
+					delete g;
+					return true;
+				});
+				retired_globals.erase(unread, retired_globals.end());
+			}
+
+			ELI::~ELI()
+			{
+				for (auto g : retired_globals) delete g;
+				delete globals.load();
+			}
+
+			// Split the work between the pool and this thread
+			template<typename Body>
+			void ELI::parallel_for(size_t count, Body body)
+			{
+				// the workers read the globals of this run
+				auto held = GlobalsLease::held_by(this);
+				auto version = held ? held->held : nullptr;
+				auto isolated = held && held->isolated;
+
+				auto chunks = std::min(count, thread_pool->size() * 4);
+				std::vector<std::exception_ptr> errors(chunks);
+				std::atomic<size_t> left{ chunks };
+
+				for (size_t c = 0; c < chunks; c++)
+				{
+					thread_pool->submit([&, c] {
+						try
+						{
+							std::unique_ptr<GlobalsLease> lease(version ? new GlobalsLease(this, version, isolated) : nullptr);
+							body(count * c / chunks, count * (c + 1) / chunks);
+						}
+						catch (...)
+						{
+							errors[c] = std::current_exception();
+						}
+
+						left.fetch_sub(1);
+					});
+				}
+
+				// help with the chunks until all are done
+				while (left.load() > 0)
+					if (!thread_pool->run_one()) std::this_thread::yield();
+
+				// the error of the first failing chunk, as if the chunks were done in order (run_guarded
+				// turns it into the error of the run, whatever the worker threw)
+				for (auto& e : errors) if (e) std::rethrow_exception(e);
+			}
+
+			// Split the elements between the pool and this thread
+			template<typename Body>
+			void ELI::parallel_chunks(const NodePtr& fn, const Env& scope, size_t arity, const NodePtr& input, size_t count, Body body)
+			{
+				if (!thread_pool || count < parallel_threshold || count < 2)
+				{
+					Applier apply(this, fn, scope, arity);
+					body(apply, 0, count);
+					return;
+				}
+
+				// the workers reach the function, the elements and the bindings of the scope
+				fn->share();
+				input->share();
+				for (auto f = scope.get(); f; f = f->parent.get())
+					for (auto& b : f->bindings) if (b.second) b.second->share();
+
+				parallel_for(count, [&](size_t from, size_t to) {
+					Applier apply(this, fn, scope, arity);
+					body(apply, from, to);
+				});
+			}
+
+			// Get the global value of a name
+			ELI::NodePtr ELI::global(SymbolId id)
+			{
+				GlobalsLease lease(this);
+				auto y = lease.globals()->find(id);
+
+				return y ? *y : NodePtr();
+			}
+
+			void ELI::define(SymbolId id, NodePtr value)
+			{
+				// globals are visible to all threads
+				value->share();
+
+				auto held = GlobalsLease::held_by(this);
+
+				// a context keeps its definitions to itself (see Context::merge)
+				if (held && held->isolated)
+				{
+					if (held->held->exclusive()) held->held->set(id, std::move(value));
+					else
+					{
+						auto old = held->held;
+						held->held = old->with(id, std::move(value), false);
+						held->held->readers.store(1);
+						release_globals(old);
+					}
+
+					if (held->context && std::find(held->context->defined.begin(), held->context->defined.end(), id) == held->context->defined.end())
+						held->context->defined.push_back(id);
+					return;
+				}
+
+				auto x = std::lock_guard<std::mutex>(symbol_mutex);
+
+				// the run that defines the name reads its own version with the name added,
+				// the other definitions published since it started stay invisible to it
+				if (held)
+				{
+					// later definitions of the run change its private version in place
+					if (held->held->exclusive()) held->held->set(id, value);
+					else
+					{
+						auto mine = held->held->with(id, value, false);
+						mine->readers.store(1);
+
+						// a private version may be read by the workers of the run too
+						auto old = held->held;
+						held->held = mine;
+						if (old->readers.fetch_sub(1) == 1 && !old->published) delete old;
+					}
+				}
+
+				auto current = globals.load();
+				auto next = current->with(id, std::move(value), true);
+
+				globals.store(next);
+				retired_globals.push_back(current);
+				reclaim_globals();
+			}
+
+			// Outcomes of the resolution of a name outside of the local frames
+			enum Resolution : unsigned int
+			{
+				resolved_global = 1,
+				resolved_builtin = 2,
+				resolved_unbound = 3
+			};
+
+			// What names resolved to outside of the local frames, for one version of the globals each.
+			// The trees are never written to during evaluation, so the cache lives beside them, one per thread.
+			struct ResolutionCache
+			{
+				static const size_t size = 1024;
+
+				struct Entry
+				{
+					unsigned long long version;
+					ELI::SymbolId symbol;
+					Resolution outcome;
+					const ELI::NodePtr* value;
+				};
+
+				Entry entries[size];
+
+				Entry& slot(ELI::SymbolId id) { return entries[id % size]; }
+			};
+
+			static thread_local ResolutionCache resolution_cache;
+
+			// A list that is not a call evaluates to itself with its head evaluated.
+			// The tree is never modified, a copy is made if the head changes.
+			static ELI::NodePtr with_head(ELI* eli, const ELI::NodePtr& tree, const ELI::NodePtr& head)
+			{
+				if (head == VALUES(tree)[0]) return tree;
+
+				auto list = eli->new_list();
+				VALUES(list) = VALUES(tree);
+				VALUES(list).set(0, head);
+				return list;
+			}
+
+			// Evaluate Lisp tree
+			// Nesting of the evaluations on this thread (see set_max_depth)
+			static thread_local size_t eval_depth = 0;
+
+			struct DepthGuard
+			{
+				const bool exceeded;
+
+				DepthGuard(size_t max_depth) : exceeded{ ++eval_depth > max_depth } {}
+				~DepthGuard() { eval_depth--; }
+			};
+
+			// Set the maximum nesting of evaluations
+			void ELI::set_max_depth(size_t depth)
+			{
+				ensure_mutable("set the maximum depth");
+				max_depth = depth;
+			}
+
+			// Look a name up
+			ELI::NodePtr ELI::resolve(const NodePtr& tree, const Env& sym)
+			{
+				auto atom = tree->atom();
+
+				// numbers are not names
+				if (atom->numeric) return tree;
+
+				auto id = atom->symbol;
+
+				// atoms made at run time are not interned, only known names may resolve
+				if (id == no_symbol) id = find_symbol(atom->value);
+				if (id == no_symbol) return tree;
+
+				// search local table
+				if (sym)
+				{
+					auto x = sym->find(id);
+					if (x) return *x;
+				}
+				// a version of the global table never changes (nor do the values it holds while it is read),
+				// so the outcome is remembered for the version and the name
+				GlobalsLease lease(this);
+				auto g = lease.globals();
+				auto& cached = resolution_cache.slot(id);
+
+				if (cached.version != g->version || cached.symbol != id)
+				{
+					cached.version = g->version;
+					cached.symbol = id;
+					cached.value = g->find(id);
+
+					if (cached.value) cached.outcome = resolved_global;
+					else if (id < builtin_nodes.size() && builtin_nodes[id]) cached.outcome = resolved_builtin;
+					else cached.outcome = resolved_unbound;
+				}
+
+				switch (cached.outcome)
+				{
+				case resolved_global:
+					return *cached.value;
+				case resolved_builtin:
+					return builtin_nodes[id];
+				default:
+					return tree;
+				}
+			}
+
+			// Evaluate a tree. Calls of Lisp functions and the tail positions of the special forms
+			// continue the loop instead of nesting, so tail recursion runs in constant stack space.
+			ELI::NodePtr ELI::eval(const NodePtr& tree, const Env& sym)
+			{
+				if (tree->is_func() || tree->is_empty())
+				{
+					return tree;
+				}
+
+				if (tree->is_atom())
+				{
+					return resolve(tree, sym);
+				}
+
+				// packed vectors hold numbers only, they evaluate to themselves
+				if (tree->kind != Node::Kind::List)
+				{
+					return tree;
+				}
+
+				DepthGuard depth{ max_depth };
+				if (depth.exceeded) throw Recursion_too_deep{ tree->to_string() };
+
+				// the tree and the scope being evaluated, the owners keep them alive once the loop moves on
+				auto current = &tree;
+				auto env = &sym;
+				NodePtr current_owner;
+				Env env_owner;
+
+				while (true)
+				{
+					auto& t = *current;
+
+					if (t->is_func() || t->is_empty()) return t;
+					if (t->is_atom()) return resolve(t, *env);
+					if (t->kind != Node::Kind::List) return t;
+
+					auto head = eval(VALUES(t)[0], *env);
+
+					if (auto fn = head->func())
+					{
+						// compiled functions run on the stack machine
+						if (fn->code) return fn->call(t, *env, this);
+
+						// the frame of a tail call replaces the caller's frame if that cannot be seen any more
+						auto frame = fn->enter(t, *env, this);
+						frame->skip_shadowed();
+						env_owner = std::move(frame);
+						env = &env_owner;
+						current_owner = fn->body;
+						current = &current_owner;
+						continue;
+					}
+
+					if (auto builtin = head->builtin())
+					{
+						if (!builtin->tail) return builtin->call(t, *env, this);
+
+						Env scope;
+						auto next = builtin->tail(t, *env, this, scope);
+						if (scope)
+						{
+							env_owner = std::move(scope);
+							env = &env_owner;
+						}
+						current_owner = std::move(next);
+						current = &current_owner;
+						continue;
+					}
+
+					return with_head(this, t, head);
+				}
+			}
+
+			// Lisp source code parser
+			struct Parser
+			{
+				const char* const text;
+				size_t i;
+				ELI* eli;
+
+				inline bool is_whitespace()
+				{
+					return text[i] == ' ' || text[i] == 9 || text[i] == 10 || text[i] == 13;
+				}
 
-				builtins["val"] = BUILTIN_SIGNATURE{
-					auto list = eli->new_list();
-					VALUES(list).insert(VALUES(list).end(), ++VALUES(tree).begin(), VALUES(tree).end());
-					return list;
-				};
+				inline void skip_whitespace()
+				{
+					while (is_whitespace()) i++;
+				}
 
-#define BUILTIN_CHECK(chk) BUILTIN_SIGNATURE{\
-					CHECK_ARG_COUNT(2);\
-					auto a0 = EVAL_ARG(1);\
-					return eli->new_atom(a0->chk() ? "1" : "");\
+				Parser(ELI* e, const char* const _text) : eli{ e }, text{ _text }, i{ 0 } {};
+
+				inline ELI::NodePtr parse_comment()
+				{
+					while (text[i] && text[i] != '}') i++;
+					if (text[i] == '}') i++;
+					return parse();
 				}
 
-				builtins["empty"] = BUILTIN_CHECK(is_empty);
-				builtins["atom"] = BUILTIN_CHECK(is_atom);
-				builtins["list"] = BUILTIN_CHECK(is_list);
-				builtins["func"] = BUILTIN_CHECK(is_func);
+				inline bool is_token_separator()
+				{
+					return is_whitespace() || text[i] == '(' || text[i] == ')' || text[i] == '{';
+				}
 
-				builtins["if"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(4);
+				inline ELI::NodePtr parse_token()
+				{
+					auto token_start = i;
 
-					auto max_count = VAL_SIZE - 1;
+					while (text[i] && !is_token_separator()) i++;
 
-					for (size_t i = 1; i < max_count; i += 2)
+					return eli->new_atom(std::string(text + token_start, text + i));
+				}
+
+				// Intern the names bound by def, let and fn in a parsed tree
+				void bind_names(const ELI::NodePtr& tree)
+				{
+					if (!tree->list() || tree->is_empty()) return;
+
+					auto& values = VALUES(tree);
+					auto head = values[0]->atom();
+					size_t first = 1, last = 0, step = 1;
+
+					if (head && head->value == "def") last = values.size() - 1, step = 2;
+					else if (head && head->value == "let") last = values.size() - 2, step = 2;
+					else if (head && head->value == "fn") last = values.size() - 1;
+
+					for (auto i = first; i < last; i += step)
 					{
-						if ((bool)*EVAL_ARG(i))
-							return EVAL_ARG(i + 1);
+						auto atom = values[i]->atom();
+						if (atom && !atom->numeric && !atom->is_empty()) atom->symbol = eli->intern(atom->value);
 					}
 
-					return EVAL_ARG(max_count);
-				};
+					for (auto& v : values) bind_names(v);
+				}
 
-				builtins["id"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(2);
-					return EVAL_ARG(1);
-				};
+				// Give the other identifiers the ids of the names they refer to (those not interned
+				// are looked up when they are evaluated, so that run-time names do not fill the table)
+				void find_names(const ELI::NodePtr& tree)
+				{
+					if (auto atom = tree->atom())
+					{
+						if (!atom->numeric && !atom->is_empty() && atom->symbol == ELI::no_symbol) atom->symbol = eli->find_symbol(atom->value);
+						return;
+					}
 
-				builtins["head"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(2);
-					auto src = EVAL_ARG(1);
-					ENSURE_LIST(src);
-					ENSURE_NOT_EMPTY(src);
-					return VALUES(src)[0];
-				};
+					if (tree->list())
+						for (auto& v : VALUES(tree)) find_names(v);
+				}
 
-				builtins["tail"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(2);
-					auto src = EVAL_ARG(1);
-					ENSURE_LIST(src);
-					if (src->is_empty()) return eli->new_list();
-					auto list = eli->new_list();
-					VALUES(list).insert(VALUES(list).end(), ++VALUES(src).begin(), VALUES(src).end());
-					return list;
-				};
+				// Parse the whole text and link its names
+				ELI::NodePtr parse_all()
+				{
+					auto tree = parse();
+					bind_names(tree);
+					find_names(tree);
+					return tree;
+				}
 
+				inline ELI::NodePtr parse_list()
+				{
+					auto output = eli->new_list();
+					while (true)
+					{
+						auto element = parse();
 
-				builtins["cons"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
+						skip_whitespace();
 
-					auto src_list = EVAL_ARG(2);
+						if (element->is_atom() && element->is_empty())
+						{
+							if (text[i] == ')') i++;
+							break;
+						}
 
-					ENSURE_LIST(src_list);
+						output->list()->push(element);
 
-					auto list = eli->new_list();
+						if (text[i] == ')')
+						{
+							i++;
+							break;
+						}
+					}
 
-					VALUES(list).push_back(EVAL_ARG(1));
+					return output;
+				}
 
-					VALUES(list).insert(VALUES(list).end(), VALUES(src_list).begin(), VALUES(src_list).end());
+				ELI::NodePtr parse()
+				{
+					skip_whitespace();
 
-					return list;
+					switch (text[i])
+					{
+					case 0: return eli->new_atom("");
+					case '(': i++;  return parse_list();
+					case '{': i++;  return parse_comment();
+					default: return parse_token();
+					}
+				}
+			};
+
+			template<typename Fn>
+			std::pair<std::string, std::string> ELI::run_guarded(Fn fn)
+			{
+				// the whole run sees one version of the globals
+				GlobalsLease lease(this);
+
+				try
+				{
+					auto result = fn();
+
+					return std::make_pair(result->to_string(), "");
+				}
+				catch (Invalid_argument invarg)
+				{
+					return std::make_pair("", "Invalid argument " + invarg.message);
+				}
+				catch (Insufficient_arguments insuff)
+				{
+					return std::make_pair("", "Insufficient arguments " + insuff.message);
+				}
+				catch (Variable_not_found vnf)
+				{
+					return std::make_pair("", "External variable not found " + vnf.var);
+				}
+				catch (Write_to_readonly_variable ro)
+				{
+					return std::make_pair("", "Attempted write to read-only variable " + ro.var);
+				}
+				catch (Function_not_found fnf)
+				{
+					return std::make_pair("", "Function not found " + fnf.func);
+				}
+				catch (Recursion_too_deep deep)
+				{
+					return std::make_pair("", "Maximum recursion depth exceeded " + deep.message);
+				}
+				catch (Symbol_table_full full)
+				{
+					return std::make_pair("", "Symbol table is full " + full.name);
+				}
+				// thrown by an external function (or out of memory)
+				catch (const std::exception& e)
+				{
+					return std::make_pair("", std::string("Exception ") + e.what());
+				}
+				catch (...)
+				{
+					return std::make_pair("", "Unknown exception");
+				}
+			}
+
+			std::pair<std::string, std::string> ELI::run(const char* text)
+			{
+				return run(cached_script(text));
+			}
+
+			// Parse Lisp code into a script run by this thread only
+			ELI::ScriptPtr ELI::parse_script(const char* text)
+			{
+				Parser parser(this, text);
+
+				auto script = std::make_shared<Script>();
+				script->tree = parser.parse_all();
+
+				return script;
+			}
+
+			// Parse Lisp code so that it can be run many times
+			ELI::ScriptPtr ELI::prepare(const char* text)
+			{
+				auto script = parse_script(text);
+				// a script may be run by several threads
+				script->tree->share();
+
+				return script;
+			}
+
+			// Execute a parsed script
+			std::pair<std::string, std::string> ELI::run(const ScriptPtr& script)
+			{
+				return run_guarded([&] { return eval(script->tree, Env{}); });
+			}
+
+			// Run the items of a batch on the pool and this thread
+			template<typename Item>
+			void ELI::run_items(size_t count, Item item)
+			{
+				// the whole batch sees one version of the globals
+				GlobalsLease lease(this);
+				auto held = GlobalsLease::held_by(this);
+				auto version = held->held;
+				auto isolated = held->isolated;
+
+				// and the definitions of an item are not seen by the next ones
+				auto items = [&](size_t from, size_t to) {
+					for (auto i = from; i < to; i++)
+					{
+						GlobalsLease own(this, version, isolated);
+						item(i);
+					}
 				};
 
-				builtins["fn"] = BUILTIN_SIGNATURE{
-					auto fn = eli->new_func();
+				if (!thread_pool || count < 2) items(0, count);
+				else parallel_for(count, items);
+			}
 
-					CHECK_ARG_COUNT(2);
+			std::vector<std::pair<std::string, std::string>> ELI::run_batch(const char* text, const std::vector<Bindings>& inputs)
+			{
+				return run_batch(cached_script(text, thread_pool != nullptr), inputs);
+			}
 
-					for (size_t i = 1; i < VAL_SIZE - 1; i++)
+			// Execute a parsed script with the bindings of every input in a local frame
+			std::vector<std::pair<std::string, std::string>> ELI::run_batch(const ScriptPtr& script, const std::vector<Bindings>& inputs)
+			{
+				// the names are interned once here (the items do not take the intern lock),
+				// the values are read by the other threads
+				std::unordered_map<std::string, SymbolId> interned;
+				std::vector<std::vector<SymbolId>> names(inputs.size());
+
+				for (size_t i = 0; i < inputs.size(); i++)
+				{
+					names[i].reserve(inputs[i].size());
+
+					for (auto& b : inputs[i])
 					{
-						// parameter names should be atoms
-						if (!VALUES(tree)[i]->is_atom()) continue;
+						auto found = interned.find(b.first);
+						if (found == interned.end()) found = interned.emplace(b.first, intern(b.first)).first;
+						names[i].push_back(found->second);
 
-						fn->func()->parameter_names.push_back(VALUES(tree)[i]->atom()->value);
-						fn->func()->body = VALUES(tree)[VAL_SIZE - 1];
+						if (b.second) b.second->share();
 					}
+				}
 
-					return fn;
-				};
+				std::vector<std::pair<std::string, std::string>> results(inputs.size());
 
-				builtins["let"] = BUILTIN_SIGNATURE{
+				run_items(inputs.size(), [&](size_t i) {
+					Env frame;
+					if (!inputs[i].empty())
+					{
+						frame = new_frame(Env{});
+						for (size_t k = 0; k < inputs[i].size(); k++)
+						{
+							auto id = names[i][k];
+							if (id != no_symbol && inputs[i][k].second) frame->bind(id, inputs[i][k].second);
+						}
+					}
 
-					CHECK_ARG_COUNT(4);
+					results[i] = run_guarded([&] { return eval(script->tree, frame); });
+				});
 
-				    // create a local copy of the symbol table
-				    auto local_sym = sym;
+				return results;
+			}
 
-					for (size_t i = 1; i < VAL_SIZE - 2; i += 2)
+			// Execute several parsed scripts
+			std::vector<std::pair<std::string, std::string>> ELI::run_batch(const std::vector<ScriptPtr>& scripts)
+			{
+				std::vector<std::pair<std::string, std::string>> results(scripts.size());
+
+				run_items(scripts.size(), [&](size_t i) {
+					results[i] = run_guarded([&] { return eval(scripts[i]->tree, Env{}); });
+				});
+
+				return results;
+			}
+
+			// Get a parsed script for the text from the cache, parsing it on a miss
+			ELI::ScriptPtr ELI::cached_script(const char* text, bool shared)
+			{
+				// FNV-1a
+				unsigned long long hash = 14695981039346656037ull;
+				for (auto c = text; *c; c++)
+					hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+
+				auto self = std::this_thread::get_id();
+				bool hit = false;
+
+				{
+					auto x = std::lock_guard<std::mutex>(script_cache_mutex);
+
+					if (!script_cache_capacity) return shared ? prepare(text) : parse_script(text);
+
+					auto cached = script_index.find(hash);
+					if (cached != script_index.end() && cached->second->text == text)
 					{
-						// names should only be atoms
-						if (!VALUES(tree)[i]->is_atom()) continue;
+						cached_scripts.splice(cached_scripts.begin(), cached_scripts, cached->second);
+						script_cache_hits++;
 
-						local_sym[VALUES(tree)[i]->atom()->value] = eli->eval(VALUES(tree)[i + 1], local_sym);
+						auto& entry = *cached->second;
+						if (!shared && entry.script && entry.owner == self) return entry.script;
+						if (entry.shared) return entry.shared;
+
+						// the tree of another thread is not touched, this text is parsed again
+						hit = shared = true;
 					}
+				}
 
-					return eli->eval(VALUES(tree)[VAL_SIZE - 1], local_sym);
-				};
+				if (!hit) script_cache_misses++;
 
-				builtins["def"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
+				// parse without holding the lock
+				auto script = shared ? prepare(text) : parse_script(text);
 
-					for (size_t i = 1; i < VAL_SIZE - 1; i += 2)
-					{
-						// names should only be atoms
-						if (!VALUES(tree)[i]->is_atom()) continue;
+				auto x = std::lock_guard<std::mutex>(script_cache_mutex);
 
-						auto x = std::lock_guard<std::mutex>(eli->symbol_mutex);
-						eli->symbols[VALUES(tree)[i]->atom()->value] = EVAL_ARG(i + 1);
+				auto cached = script_index.find(hash);
+				if (cached != script_index.end() && cached->second->text == text)
+				{
+					// the same text was cached meanwhile: what the entry lacks is filled in
+					auto& entry = *cached->second;
+					if (shared && !entry.shared) entry.shared = script;
+					else if (!shared && !entry.script)
+					{
+						entry.owner = self;
+						entry.script = script;
 					}
 
-					return eli->new_atom("");
-				};
+					return script;
+				}
 
-				// Operations on atoms
-				builtins["!"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(2);
-					auto a0 = EVAL_ARG(1);
-					return eli->new_atom(!(bool)*a0);
-				};
+				// another text with the same hash is replaced
+				if (cached != script_index.end())
+				{
+					cached_scripts.erase(cached->second);
+					script_index.erase(cached);
+				}
 
-#define BUILTIN_BINARY(expr) BUILTIN_SIGNATURE{\
-					CHECK_ARG_COUNT(3);\
-					auto a0 = EVAL_ARG(1);\
-					auto a1 = EVAL_ARG(2);\
-					return eli->new_atom(expr);\
-				};
+				if (shared) cached_scripts.push_front({ hash, text, std::thread::id{}, nullptr, script });
+				else cached_scripts.push_front({ hash, text, self, script, nullptr });
+				script_index[hash] = cached_scripts.begin();
+
+				while (cached_scripts.size() > script_cache_capacity)
+				{
+					script_index.erase(cached_scripts.back().hash);
+					cached_scripts.pop_back();
+				}
+
+				return script;
+			}
+
+			// Set the number of scripts kept parsed by `run(text)`
+			void ELI::set_cache_capacity(size_t capacity)
+			{
+				ensure_mutable("set the cache capacity");
+				auto x = std::lock_guard<std::mutex>(script_cache_mutex);
+
+				script_cache_capacity = capacity;
+
+				while (cached_scripts.size() > script_cache_capacity)
+				{
+					script_index.erase(cached_scripts.back().hash);
+					cached_scripts.pop_back();
+				}
+			}
+
+			// Get the script cache statistics
+			ELI::CacheStats ELI::cache_stats()
+			{
+				auto x = std::lock_guard<std::mutex>(script_cache_mutex);
+
+				return CacheStats{ script_cache_hits, script_cache_misses, cached_scripts.size(), script_cache_capacity };
+			}
 
-				builtins["&"] = BUILTIN_BINARY((bool)*a0 && (bool)*a1);
-				builtins["|"] = BUILTIN_BINARY((bool)*a0 || (bool)*a1);
-				builtins["^"] = BUILTIN_BINARY((((bool)*a0) && !((bool)*a1)) || (!((bool)*a0) && ((bool)*a1)));
-				builtins["+"] = BUILTIN_BINARY((double)*a0 + (double)*a1);
-				builtins["*"] = BUILTIN_BINARY((double)*a0 * (double)*a1);
-				builtins["-"] = BUILTIN_BINARY((double)*a0 - (double)*a1);
-				builtins["/"] = BUILTIN_BINARY((double)*a0 / (double)*a1);
-				builtins["%"] = BUILTIN_BINARY(std::fmod((double)*a0, (double)*a1));
-				builtins["<"] = BUILTIN_BINARY((double)*a0 < (double)*a1);
-				builtins[">"] = BUILTIN_BINARY((double)*a0 > (double)*a1);
-				builtins["<="] = BUILTIN_BINARY((double)*a0 <= (double)*a1);
-				builtins[">="] = BUILTIN_BINARY((double)*a0 >= (double)*a1);
-				builtins["="] = BUILTIN_BINARY(a0->compare(a1));
-				builtins["!="] = BUILTIN_BINARY(!a0->compare(a1));
+			ELI::Context::Context(ELI& e) : image{ &e }, overlay{ e.acquire_globals() }, allocator{ e.allocator }, runs{ 0 }, failures{ 0 }
+			{
+				image->contexts.fetch_add(1);
+			}
 
+			ELI::Context::~Context()
+			{
+				image->release_globals(overlay);
+				image->contexts.fetch_sub(1);
+			}
 
-				// Integrations
-				builtins["get"] = BUILTIN_SIGNATURE{
-					// Get value from external variable
-					CHECK_ARG_COUNT(2);
-					ENSURE_ATOM(VALUES(tree)[1]);
-					return eli->get_var(VALUES(tree)[1]->atom()->value.c_str());
-				};
+			// Set the allocator for the nodes and frames made by the runs of this context
+			void ELI::Context::set_allocator(Allocator a)
+			{
+				allocator = a;
+			}
 
-				builtins["set"] = BUILTIN_SIGNATURE{
-					// Set value of external variable
-					CHECK_ARG_COUNT(3);
-					ENSURE_ATOM(VALUES(tree)[1]);
+			std::pair<std::string, std::string> ELI::Context::run(const char* text)
+			{
+				return run(image->cached_script(text));
+			}
 
-					return eli->set_var
-					(
-						VALUES(tree)[1]->atom()->value.c_str(),
-						EVAL_ARG(2)
-					);
-				};
+			// Execute a parsed script reading the globals of this context
+			std::pair<std::string, std::string> ELI::Context::run(const ScriptPtr& script)
+			{
+				GlobalsLease lease(this);
 
-				builtins["call"] = BUILTIN_SIGNATURE{
-					// Call external function, return its result
-					CHECK_ARG_COUNT(3);
-					ENSURE_ATOM(VALUES(tree)[1]);
+				auto result = image->run(script);
+				runs++;
+				if (!result.second.empty()) failures++;
 
-					auto funcname = VALUES(tree)[1]->atom()->value;
-					auto funcptr = eli->functions.find(funcname);
-					if (funcptr == eli->functions.end())
-						throw Function_not_found{funcname};
+				return result;
+			}
 
-					std::vector<std::string> v;
+			// Execute a compiled program reading the globals of this context
+			std::pair<std::string, std::string> ELI::Context::run(const ProgramPtr& program)
+			{
+				GlobalsLease lease(this);
 
-					auto a1 = EVAL_ARG(2);
-					ENSURE_LIST(a1);
+				auto result = image->run(program);
+				runs++;
+				if (!result.second.empty()) failures++;
 
-					for (auto param : a1->list()->values)
-					{
-						v.push_back (param->to_string ());
-					}
+				return result;
+			}
 
-					return eli->new_list((*(funcptr->second)) (v));
-				};
+			// Rebuild the overlay on the current version of the image
+			void ELI::Context::refresh()
+			{
+				auto next = image->acquire_globals();
 
-				// cmath proxy
+				for (auto id : defined)
+				{
+					if (next->exclusive())
+					{
+						next->set(id, *overlay->find(id));
+						continue;
+					}
 
-#define MATH_UNARY(op) BUILTIN_SIGNATURE{\
-					CHECK_ARG_COUNT(2);\
-					auto a0 = EVAL_ARG(1);\
-					ENSURE_ATOM(a0);\
-					return eli->new_atom((double)std::op((long double) (double)*a0));\
+					auto mine = next->with(id, *overlay->find(id), false);
+					mine->readers.store(1);
+					image->release_globals(next);
+					next = mine;
 				}
 
-				builtins["sqrt"] = MATH_UNARY(sqrt);
-				builtins["abs"] = MATH_UNARY(abs);
-				builtins["sin"] = MATH_UNARY(sin);
-				builtins["cos"] = MATH_UNARY(cos);
-				builtins["tan"] = MATH_UNARY(tan);
-				builtins["asin"] = MATH_UNARY(asin);
-				builtins["acos"] = MATH_UNARY(acos);
-				builtins["atan"] = MATH_UNARY(atan);
-				builtins["sinCos"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(2);
-					auto a0 = EVAL_ARG(1);
-					ENSURE_ATOM(a0);
+				image->release_globals(overlay);
+				overlay = next;
+			}
 
-					auto v = (double)*a0;
-					auto list = eli->new_list();
-					VALUES(list).push_back(eli->new_atom(std::sin(v)));
-					VALUES(list).push_back(eli->new_atom(std::cos(v)));
+			// Publish some of the definitions of this context as one new version of the image
+			size_t ELI::Context::merge(const std::vector<std::string>& names)
+			{
+				auto x = std::lock_guard<std::mutex>(image->symbol_mutex);
 
-					return list;
-				};
+				auto current = image->globals.load();
+				Globals* next = nullptr;
+				size_t merged = 0;
 
-				builtins["atan2"] = BUILTIN_BINARY(std::atan2((double)*a0, (double)*a1));
-				builtins["pow"] = BUILTIN_BINARY(std::pow((double)*a1, (double)*a0));
-				builtins["log"] = BUILTIN_BINARY(std::log((double)*a1) / std::log((double)*a0));
-				builtins["floor"] = MATH_UNARY(floor);
-				builtins["ceil"] = MATH_UNARY(ceil);
+				for (auto& name : names)
+				{
+					auto id = image->find_symbol(name);
+					if (id == no_symbol || std::find(defined.begin(), defined.end(), id) == defined.end()) continue;
 
-				// More complex functions aka STDLIB
-				builtins["length"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(2);
-					auto a0 = EVAL_ARG(1);
-					ENSURE_LIST(a0);
+					// the new version is not read before it is stored
+					if (next) next->set(id, *overlay->find(id));
+					else next = current->with(id, *overlay->find(id), true);
+					merged++;
+				}
 
-					return eli->new_atom((unsigned long long) VALUES(a0).size());
-				};
+				if (next)
+				{
+					image->globals.store(next);
+					image->retired_globals.push_back(current);
+					image->reclaim_globals();
+				}
 
-				builtins["reverse"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(2);
-					auto a0 = EVAL_ARG(1);
-					ENSURE_LIST(a0);
-					auto list = eli->new_list();
+				return merged;
+			}
 
-					std::reverse_copy(VALUES(a0).begin(), VALUES(a0).end(), std::back_inserter(VALUES(list)));
-					return list;
+			// Get the context counters
+			ELI::Context::Stats ELI::Context::stats() const
+			{
+				return Stats{ runs, failures, defined.size() };
+			}
+
+			// Compiled program: bytecode for a stack machine and the nodes it refers to
+			struct ELI::Program : std::enable_shared_from_this<ELI::Program>
+			{
+				enum class Op : unsigned char
+				{
+					Const,        // push constants[a]
+					Load,         // push the value of name a (local, global, otherwise constants[b])
+					Guard,        // if builtin a is shadowed, push eval(constants[b]) and go to c
+					Pop,
+					Jump,         // go to a
+					JumpIfNot,    // pop a value and go to a if it is false
+					Enter,        // open a local frame
+					Bind,         // pop a value and bind it to name a in the local frame
+					Leave,        // close the local frame
+					Def,          // pop a value and store it as global a
+					MakeFn,       // push a function made from the prototype constants[a]
+					Apply,        // apply the head on the stack to the tree constants[a] (see execute)
+					Arg,          // go to b if the function being applied takes no parameter number a
+					Call,         // call the function applied by the last Apply with the arguments on the stack
+					Return,
+					Not,
+					Math,         // unary math function number a
+					Add, Sub, Mul, Div, Mod,
+					Less, Greater, LessEqual, GreaterEqual,
+					Equal, NotEqual,
+					And, Or, Xor,
+					Atan2, Pow, Log
 				};
 
-				builtins["concat"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
-					auto a0 = EVAL_ARG(1);
-					auto a1 = EVAL_ARG(2);
-					ENSURE_LIST(a0);
-					ENSURE_LIST(a1);
+				struct Instruction
+				{
+					Op op;
+					unsigned a, b, c;
+				};
 
-					auto list = eli->new_list();
-					std::copy(VALUES(a0).begin(), VALUES(a0).end(), std::back_inserter(VALUES(list)));
-					std::copy(VALUES(a1).begin(), VALUES(a1).end(), std::back_inserter(VALUES(list)));
-					return list;
+				// Call of a higher-order builtin with its `fn` arguments replaced by compiled prototypes.
+				// It is used while the builtin and the names in `guards` are not shadowed.
+				struct Template
+				{
+					NodePtr tree;
+					BuiltinFunc fn;
+					std::vector<SymbolId> guards;
 				};
 
-				builtins["iota"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(2);
-					auto a0 = EVAL_ARG(1);
-					ENSURE_ATOM(a0);
-					auto list = eli->new_list();
+				static const unsigned no_template = ~0u;
 
-					for (unsigned long long i = 0; i < (double)*a0; i++)
-						VALUES(list).push_back(eli->new_atom(i));
+				std::vector<Instruction> code;
+				std::vector<NodePtr> constants;
+				std::vector<Template> templates;
+			};
 
-					return list;
-				};
+			// Unary math functions compiled into the bytecode (the functions of the MATH_UNARY builtins)
+			static const struct
+			{
+				const char* name;
+				double(*fn)(double);
+			} math_functions[] =
+			{
+				{ "sqrt", math_sqrt },
+				{ "abs", math_abs },
+				{ "sin", math_sin },
+				{ "cos", math_cos },
+				{ "tan", math_tan },
+				{ "asin", math_asin },
+				{ "acos", math_acos },
+				{ "atan", math_atan },
+				{ "floor", math_floor },
+				{ "ceil", math_ceil },
+			};
 
-				builtins["take"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
-					auto a0 = EVAL_ARG(1);
-					auto a1 = EVAL_ARG(2);
-					ENSURE_ATOM(a0);
-					ENSURE_LIST(a1);
+			// Binary builtins compiled into the bytecode
+			static const std::pair<const char*, ELI::Program::Op> binary_operations[] =
+			{
+				{ "+", ELI::Program::Op::Add },
+				{ "-", ELI::Program::Op::Sub },
+				{ "*", ELI::Program::Op::Mul },
+				{ "/", ELI::Program::Op::Div },
+				{ "%", ELI::Program::Op::Mod },
+				{ "<", ELI::Program::Op::Less },
+				{ ">", ELI::Program::Op::Greater },
+				{ "<=", ELI::Program::Op::LessEqual },
+				{ ">=", ELI::Program::Op::GreaterEqual },
+				{ "=", ELI::Program::Op::Equal },
+				{ "!=", ELI::Program::Op::NotEqual },
+				{ "&", ELI::Program::Op::And },
+				{ "|", ELI::Program::Op::Or },
+				{ "^", ELI::Program::Op::Xor },
+				{ "atan2", ELI::Program::Op::Atan2 },
+				{ "pow", ELI::Program::Op::Pow },
+				{ "log", ELI::Program::Op::Log },
+			};
 
-					if (a1->is_empty()) return a1;
+			// Builtins that call their function argument; `fn` forms passed to them are compiled
+			static const char* const higher_order_builtins[] =
+			{
+				"map", "filter", "zipWith", "takeWhile", "dropWhile", "foldl", "foldl1", "foldr", "foldr1"
+			};
 
-					auto list = eli->new_list();
+			// Bytecode compiler
+			struct ELI::Compiler
+			{
+				using Op = Program::Op;
 
-					for (size_t i = 0; i < (double)*a0 && i < VALUES(a1).size(); i++)
-						VALUES(list).push_back(VALUES(a1)[i]);
+				ELI* eli;
+				std::shared_ptr<Program> program;
+				// functions whose bodies are still to be compiled
+				std::vector<NodePtr> pending;
 
-					return list;
-				};
+				Compiler(ELI* e) : eli{ e }, program{ std::make_shared<Program>() } {}
 
-				builtins["drop"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
-					auto a0 = EVAL_ARG(1);
-					auto a1 = EVAL_ARG(2);
-					ENSURE_ATOM(a0);
-					ENSURE_LIST(a1);
+				unsigned constant(NodePtr node)
+				{
+					program->constants.push_back(node);
+					return (unsigned)program->constants.size() - 1;
+				}
 
-					if (a1->is_empty()) return a1;
+				size_t emit(Op op, unsigned a = 0, unsigned b = 0, unsigned c = 0)
+				{
+					program->code.push_back({ op, a, b, c });
+					return program->code.size() - 1;
+				}
 
-					auto list = eli->new_list();
+				unsigned here()
+				{
+					return (unsigned)program->code.size();
+				}
 
-					for (auto i = (size_t)(double)*a0; i < VALUES(a1).size(); i++)
-						VALUES(list).push_back(VALUES(a1)[i]);
+				// Id of the builtin named by a node (no_symbol if it is not a builtin name)
+				SymbolId builtin_id(const NodePtr& node)
+				{
+					if (!node->is_atom()) return no_symbol;
 
-					return list;
-				};
+					auto id = node->atom()->symbol;
+					if (id == no_symbol || id >= eli->builtin_table.size() || !eli->builtin_table[id]) return no_symbol;
 
-				builtins["map"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
-					auto a0 = EVAL_ARG(1);
-					auto a1 = EVAL_ARG(2);
+					return id;
+				}
 
-					ENSURE_FUNC(a0);
-					ENSURE_LIST(a1);
+				static bool is_higher_order(const std::string& name)
+				{
+					for (auto hof : higher_order_builtins)
+						if (name == hof) return true;
 
-					if (a1->is_empty()) return a1;
+					return false;
+				}
 
-					auto list = eli->new_list();
-					auto invocation = eli->new_list();
-					VALUES(invocation).push_back(a0);
-					VALUES(invocation).push_back(eli->new_atom(""));
+				// Compile code that pushes the value of a tree
+				void compile(const NodePtr& tree)
+				{
+					if (tree->is_func() || tree->is_empty())
+					{
+						emit(Op::Const, constant(tree));
+						return;
+					}
 
-					for (auto v : VALUES(a1))
+					if (tree->is_atom())
 					{
-						VALUES(invocation)[1] = v;
-						VALUES(list).push_back(eli->eval(invocation, sym));
+						auto atom = tree->atom();
+
+						// a compiled name is loaded by id, so it gets interned even if nothing binds it yet
+						auto id = atom->numeric ? no_symbol : name_id(eli, tree);
+
+						if (id == no_symbol)
+						{
+							emit(Op::Const, constant(tree));
+							return;
+						}
+
+						// a builtin name that is not bound to anything else resolves to a prebuilt node
+						auto fallback = builtin_id(tree) != no_symbol ? eli->builtin_nodes[id] : tree;
+						emit(Op::Load, id, constant(fallback));
+						return;
 					}
 
-					return list;
-				};
+					auto id = builtin_id(VALUES(tree)[0]);
 
-				builtins["filter"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
-					auto a0 = EVAL_ARG(1);
-					auto a1 = EVAL_ARG(2);
+					if (id == no_symbol || !compile_builtin(id, tree))
+						compile_call(tree);
+				}
 
-					ENSURE_FUNC(a0);
-					ENSURE_LIST(a1);
+				// Compile a call of a value that is only known at run time
+				void compile_call(const NodePtr& tree)
+				{
+					compile(VALUES(tree)[0]);
 
-					if (a1->is_empty()) return a1;
+					auto apply = emit(Op::Apply, constant(tree), make_template(tree));
 
-					auto list = eli->new_list();
-					auto invocation = eli->new_list();
-					VALUES(invocation).push_back(a0);
-					VALUES(invocation).push_back(eli->new_atom(""));
+					std::vector<size_t> skips;
 
-					for (auto v : VALUES(a1))
+					for (size_t i = 1; i < VAL_SIZE; i++)
 					{
-						VALUES(invocation)[1] = v;
-						auto predicate = eli->eval(invocation, sym);
-
-						if ((bool)*predicate)
-							VALUES(list).push_back(v);
+						skips.push_back(emit(Op::Arg, (unsigned)i - 1));
+						compile(VALUES(tree)[i]);
 					}
 
-					return list;
-				};
+					auto call = emit(Op::Call);
 
-				builtins["zipWith"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(4);
-					auto a0 = EVAL_ARG(1);
-					auto a1 = EVAL_ARG(2);
-					auto a2 = EVAL_ARG(3);
+					for (auto skip : skips)
+						program->code[skip].b = (unsigned)call;
 
-					ENSURE_FUNC(a0);
-					ENSURE_LIST(a1);
-					ENSURE_LIST(a2);
+					program->code[apply].c = here();
+				}
 
-					auto list = eli->new_list();
+				// Start a builtin compiled inline: the tree is evaluated as is if the name gets shadowed
+				size_t guard(SymbolId id, const NodePtr& tree)
+				{
+					return emit(Op::Guard, id, constant(tree));
+				}
 
-					if (a1->is_empty() || a2->is_empty()) return list;
+				void end_guard(size_t guard)
+				{
+					program->code[guard].c = here();
+				}
 
-					auto invocation = eli->new_list();
-					VALUES(invocation).push_back(a0);
-					VALUES(invocation).push_back(eli->new_atom(""));
-					VALUES(invocation).push_back(eli->new_atom(""));
+				// Compile a builtin inline. The builtins are only compiled when they have enough
+				// arguments, otherwise the builtin itself is called to report the error.
+				bool compile_builtin(SymbolId id, const NodePtr& tree)
+				{
+					auto& name = VALUES(tree)[0]->atom()->value;
+					auto size = VAL_SIZE;
 
-					for (size_t i = 0; i < VALUES(a1).size() && i < VALUES(a2).size(); i++)
+					for (auto& op : binary_operations)
 					{
-						VALUES(invocation)[1] = VALUES(a1)[i];
-						VALUES(invocation)[2] = VALUES(a2)[i];
-						VALUES(list).push_back(eli->eval(invocation, sym));
+						if (name != op.first) continue;
+						if (size < 3) return false;
+
+						auto g = guard(id, tree);
+						compile(VALUES(tree)[1]);
+						compile(VALUES(tree)[2]);
+						emit(op.second);
+						end_guard(g);
+						return true;
 					}
-					
-					return list;
-				};
-
-				builtins["takeWhile"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
-					auto a0 = EVAL_ARG(1);
-					auto a1 = EVAL_ARG(2);
-					ENSURE_FUNC(a0);
-					ENSURE_LIST(a1);
-
-					if (a1->is_empty()) return a1;
-
-					auto list = eli->new_list();
-					auto invocation = eli->new_list();
-					VALUES(invocation).push_back(a0);
-					VALUES(invocation).push_back(eli->new_atom(""));
 
-					for (auto v : VALUES(a1))
+					for (unsigned i = 0; i < sizeof(math_functions) / sizeof(math_functions[0]); i++)
 					{
-						VALUES(invocation)[1] = v;
-						auto predicate = eli->eval(invocation, sym);
-						if (!(bool)*predicate) break;
-						VALUES(list).push_back(v);
+						if (name != math_functions[i].name) continue;
+						if (size < 2) return false;
+
+						auto g = guard(id, tree);
+						compile(VALUES(tree)[1]);
+						emit(Op::Math, i);
+						end_guard(g);
+						return true;
 					}
 
-					return list;
-				};
-
-				builtins["dropWhile"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
-					auto a0 = EVAL_ARG(1);
-					auto a1 = EVAL_ARG(2);
-					ENSURE_FUNC(a0);
-					ENSURE_LIST(a1);
+					if ((name == "!" || name == "id") && size >= 2)
+					{
+						auto g = guard(id, tree);
+						compile(VALUES(tree)[1]);
+						if (name == "!") emit(Op::Not);
+						end_guard(g);
+						return true;
+					}
 
-					if (a1->is_empty()) return a1;
+					if (name == "seq" && size >= 2)
+					{
+						auto g = guard(id, tree);
 
-					auto list = eli->new_list();
-					auto invocation = eli->new_list();
-					VALUES(invocation).push_back(a0);
-					VALUES(invocation).push_back(eli->new_atom(""));
+						for (size_t i = 1; i < size - 1; i++)
+						{
+							compile(VALUES(tree)[i]);
+							emit(Op::Pop);
+						}
 
-					bool nodrop = false;
+						compile(VALUES(tree)[size - 1]);
+						end_guard(g);
+						return true;
+					}
 
-					for (auto v : VALUES(a1))
+					if (name == "if" && size >= 4)
 					{
-						if (!nodrop)
-						{
-							VALUES(invocation)[1] = v;
-							auto predicate = eli->eval(invocation, sym);
-							if ((bool)*predicate) continue;
+						auto g = guard(id, tree);
+						auto max_count = size - 1;
+						std::vector<size_t> exits;
 
-							nodrop = true;
+						for (size_t i = 1; i < max_count; i += 2)
+						{
+							compile(VALUES(tree)[i]);
+							auto next = emit(Op::JumpIfNot);
+							compile(VALUES(tree)[i + 1]);
+							exits.push_back(emit(Op::Jump));
+							program->code[next].a = here();
 						}
-						VALUES(list).push_back(v);
-					}
 
-					return list;
-				};
+						compile(VALUES(tree)[max_count]);
 
-				builtins["repeat"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
-					auto a0 = EVAL_ARG(1);
-					auto a1 = EVAL_ARG(2);
-					ENSURE_ATOM(a0);
+						for (auto exit : exits)
+							program->code[exit].a = here();
+
+						end_guard(g);
+						return true;
+					}
+
+					if (name == "let" && size >= 4)
+					{
+						auto g = guard(id, tree);
+						emit(Op::Enter);
 
-					auto list = eli->new_list();
+						for (size_t i = 1; i < size - 2; i += 2)
+						{
+							// names should only be atoms
+							if (!VALUES(tree)[i]->is_atom()) continue;
 
-					auto count = (size_t)(double)*a0;
+							compile(VALUES(tree)[i + 1]);
+							emit(Op::Bind, name_id(eli, VALUES(tree)[i]));
+						}
 
-					while (count--)
-					{
-						VALUES(list).push_back(a1);
+						compile(VALUES(tree)[size - 1]);
+						emit(Op::Leave);
+						end_guard(g);
+						return true;
 					}
 
-					return list;
-				};
+					if (name == "def" && size >= 3)
+					{
+						// a name that cannot be interned is reported by the builtin when the code runs
+						for (size_t i = 1; i < size - 1; i += 2)
+							if (VALUES(tree)[i]->is_atom() && name_id(eli, VALUES(tree)[i]) == no_symbol) return false;
 
-				builtins["foldl1"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
-					auto a0 = EVAL_ARG(1);
-					auto a1 = EVAL_ARG(2);
-					ENSURE_FUNC(a0);
-					ENSURE_NOT_EMPTY(a1);
-					ENSURE_LIST(a1);
+						auto g = guard(id, tree);
 
-					if (VALUES(a1).size() == 1) return VALUES(a1)[0];
+						for (size_t i = 1; i < size - 1; i += 2)
+						{
+							// names should only be atoms
+							if (!VALUES(tree)[i]->is_atom()) continue;
 
-					auto invocation = eli->new_list();
-					VALUES(invocation).push_back(a0);
-					VALUES(invocation).push_back(VALUES(a1)[0]);
-					VALUES(invocation).push_back(VALUES(a1)[1]);
+							auto name_symbol = name_id(eli, VALUES(tree)[i]);
 
-					auto accum = eli->eval(invocation, sym);
+							compile(VALUES(tree)[i + 1]);
+							emit(Op::Def, name_symbol);
+						}
 
-					for (size_t i = 2; i < VALUES(a1).size(); i++)
-					{
-						VALUES(invocation)[1] = accum;
-						VALUES(invocation)[2] = VALUES(a1)[i];
-						accum = eli->eval(invocation, sym);
+						emit(Op::Const, constant(eli->new_atom("")));
+						end_guard(g);
+						return true;
 					}
 
-					return accum;
-				};
-
-				builtins["foldl"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(4);
-					auto a0 = EVAL_ARG(1); // fn
-					auto a1 = EVAL_ARG(2); // accum
-					auto a2 = EVAL_ARG(3); // list
+					if (name == "fn" && size >= 2)
+					{
+						auto g = guard(id, tree);
+						emit(Op::MakeFn, constant(prototype(tree)));
+						end_guard(g);
+						return true;
+					}
 
-					ENSURE_FUNC(a0);
-					ENSURE_LIST(a2);
+					return false;
+				}
 
-					if (a2->is_empty()) return a1;
+				// Function prototype for a `fn` form, its body is compiled later
+				NodePtr prototype(const NodePtr& tree)
+				{
+					auto fn = eli->new_func();
+					auto f = fn->func();
 
-					auto invocation = eli->new_list();
-					VALUES(invocation).push_back(a0);
-					VALUES(invocation).push_back(a1);
-					VALUES(invocation).push_back(VALUES(a2)[0]);
+					for (size_t i = 1; i < VAL_SIZE - 1; i++)
+					{
+						// parameter names should be atoms
+						if (!VALUES(tree)[i]->is_atom()) continue;
 
-					auto accum = eli->eval(invocation, sym);
+						f->parameter_names.push_back(VALUES(tree)[i]->atom()->value);
+						f->parameters.push_back(name_id(eli, VALUES(tree)[i]));
+						f->body = VALUES(tree)[VAL_SIZE - 1];
+					}
 
-					for (size_t i = 1; i < VALUES(a2).size(); i++)
+					if (f->body)
 					{
-						VALUES(invocation)[1] = accum;
-						VALUES(invocation)[2] = VALUES(a2)[i];
-						accum = eli->eval(invocation, sym);
+						f->code = program.get();
+						pending.push_back(fn);
 					}
 
-					return accum;
-				};
+					return fn;
+				}
 
-				builtins["foldr"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(4);
-					auto a0 = EVAL_ARG(1); // fn
-					auto a1 = EVAL_ARG(2); // accum
-					auto a2 = EVAL_ARG(3); // list
+				// Template for a call of a higher-order builtin (Program::no_template if there is nothing to compile)
+				unsigned make_template(const NodePtr& tree)
+				{
+					auto id = builtin_id(VALUES(tree)[0]);
+					if (id == no_symbol || !is_higher_order(VALUES(tree)[0]->atom()->value)) return Program::no_template;
 
-					ENSURE_FUNC(a0);
-					ENSURE_LIST(a2);
+					Program::Template t;
+					t.fn = eli->builtin_table[id];
+					t.tree = substitute(tree, t.guards);
 
-					if (a2->is_empty()) return a1;
+					if (!t.tree) return Program::no_template;
 
-					auto count = VALUES(a2).size();
-					auto invocation = eli->new_list();
-					VALUES(invocation).push_back(a0);
-					VALUES(invocation).push_back(VALUES(a2)[count - 1]);
-					VALUES(invocation).push_back(a1);
+					program->templates.push_back(t);
+					return (unsigned)program->templates.size() - 1;
+				}
 
-					auto accum = eli->eval(invocation, sym);
+				// Copy of a higher-order builtin call with its function argument (also those of the nested
+				// higher-order calls) replaced by a prototype; nullptr if there is nothing to replace.
+				// Other `fn` arguments (such as an accumulator) stay forms, they are made at run time.
+				NodePtr substitute(const NodePtr& tree, std::vector<SymbolId>& guards)
+				{
+					NodePtr copy;
 
-					for (int i = count - 2; i >= 0; i--)
+					for (size_t i = 1; i < VAL_SIZE; i++)
 					{
-						VALUES(invocation)[1] = VALUES(a2)[i];
-						VALUES(invocation)[2] = accum;
-						accum = eli->eval(invocation, sym);
-					}
+						auto& arg = VALUES(tree)[i];
 
-					return accum;
-				};
+						if (!arg->is_list() || arg->is_empty()) continue;
 
-				builtins["foldr1"] = BUILTIN_SIGNATURE{
-					CHECK_ARG_COUNT(3);
-					auto a0 = EVAL_ARG(1); // fn
-					auto a1 = EVAL_ARG(2); // list
+						auto id = builtin_id(VALUES(arg)[0]);
+						if (id == no_symbol) continue;
 
-					ENSURE_FUNC(a0);
-					ENSURE_NOT_EMPTY(a1);
-					ENSURE_LIST(a1);
+						auto& name = VALUES(arg)[0]->atom()->value;
+						NodePtr replacement;
 
-					auto count = VALUES(a1).size();
+						if (name == "fn")
+						{
+							if (i == 1 && VALUES(arg).size() >= 2) replacement = prototype(arg);
+						}
+						else if (is_higher_order(name))
+							replacement = substitute(arg, guards);
 
-					if (count == 1) return VALUES(a1)[0];
+						if (!replacement) continue;
 
-					auto invocation = eli->new_list();
-					VALUES(invocation).push_back(a0);
-					VALUES(invocation).push_back(VALUES(a1)[count - 2]);
-					VALUES(invocation).push_back(VALUES(a1)[count - 1]);
+						guards.push_back(id);
 
-					auto accum = eli->eval(invocation, sym);
+						if (!copy)
+						{
+							copy = eli->new_list();
+							VALUES(copy) = VALUES(tree);
+						}
 
-					for (int i = count - 3; i >= 0; i--)
-					{
-						VALUES(invocation)[1] = VALUES(a1)[i];
-						VALUES(invocation)[2] = accum;
-						accum = eli->eval(invocation, sym);
+						VALUES(copy).set(i, replacement);
 					}
 
-					return accum;
-				};
-			}
+					return copy;
+				}
 
-			// Evaluate Lisp tree
-			ELI::NodePtr ELI::eval(NodePtr tree, SymbolTable sym)
-			{
-				if (tree->is_func() || tree->is_empty())
+				// Copy of a template tree whose prototypes keep the program alive, like the functions
+				// made by MakeFn: the builtin may return them (in a lazy sequence or as a fold result)
+				static NodePtr instantiate(ELI* eli, const NodePtr& tree, const Program* program)
 				{
-					return tree;
+					auto copy = eli->new_list();
+					VALUES(copy) = VALUES(tree);
+
+					for (size_t i = 1; i < VAL_SIZE; i++)
+					{
+						auto& arg = VALUES(tree)[i];
+
+						if (auto f = arg->func())
+						{
+							if (f->code != program || f->program) continue;
+
+							auto fn = eli->make_node<Func>(*f);
+							fn->program = program->shared_from_this();
+							VALUES(copy).set(i, fn);
+						}
+						else if (arg->is_list() && !arg->is_empty() && VALUES(arg)[0]->is_atom() && is_higher_order(VALUES(arg)[0]->atom()->value))
+							VALUES(copy).set(i, instantiate(eli, arg, program));
+					}
+
+					return copy;
 				}
 
-				if (tree->is_atom())
+				void compile_pending()
 				{
-					// search local table
-					auto x = sym.find(tree->atom()->value);
-					if (x != sym.end()) return x->second;
-					// search global table
-					auto y = symbols.find(tree->atom()->value);
-					if (y != symbols.end()) return y->second;
-					// search builtin function
-					auto bptr = builtins.find(tree->atom()->value);
-					if (bptr != builtins.end()) return new_builtin(bptr->first, bptr->second);
+					while (!pending.empty())
+					{
+						auto fn = pending.back();
+						pending.pop_back();
 
-					return tree;
+						fn->func()->entry = here();
+						compile(fn->func()->body);
+						emit(Op::Return);
+					}
 				}
+			};
+
+			// Stacks of the bytecode machine
+			struct MachineState
+			{
+				struct CallFrame
+				{
+					const ELI::Program* program;
+					size_t pc;
+					ELI::Env env;
+					// keeps the program of the called function alive
+					ELI::NodePtr callee;
+				};
+
+				std::vector<ELI::NodePtr> stack;
+				std::vector<CallFrame> calls;
+				// environments saved by Enter
+				std::vector<ELI::Env> scopes;
+				// stack positions of the functions being applied
+				std::vector<size_t> bases;
 
-				if (tree->is_list())
+				void clear()
 				{
-					auto head = eval(tree->list()->values[0], sym);
-					VALUES(tree)[0] = head;
-					if (head->is_func()) return head->call(tree, sym, this);
+					stack.clear();
+					calls.clear();
+					scopes.clear();
+					bases.clear();
 				}
+			};
 
-				return tree;
-			}
+			// The states are reused by the nested and the following executions on the same thread
+			static thread_local std::vector<std::unique_ptr<MachineState>> machine_pool;
 
-			// Lisp source code parser
-			struct Parser
+			struct MachineLease
 			{
-				const char* const text;
-				size_t i;
-				ELI* eli;
+				std::unique_ptr<MachineState> state;
 
-				inline bool is_whitespace()
+				MachineLease()
 				{
-					return text[i] == ' ' || text[i] == 9 || text[i] == 10 || text[i] == 13;
+					if (machine_pool.empty())
+					{
+						state.reset(new MachineState);
+					}
+					else
+					{
+						state = std::move(machine_pool.back());
+						machine_pool.pop_back();
+					}
 				}
 
-				inline void skip_whitespace()
+				~MachineLease()
 				{
-					while (is_whitespace()) i++;
+					state->clear();
+					machine_pool.push_back(std::move(state));
 				}
+			};
 
-				Parser(ELI* e, const char* const _text) : eli{ e }, text{ _text }, i{ 0 } {};
+			// Check if a builtin name is bound to something else in the given scope
+			bool ELI::is_shadowed(SymbolId id, const Env& sym)
+			{
+				if (sym && sym->find(id)) return true;
 
-				inline ELI::NodePtr parse_comment()
-				{
-					while (text[i] && text[i] != '}') i++;
-					if (text[i] == '}') i++;
-					return parse();
+				return (bool)global(id);
+			}
+
+			// Execute compiled code
+			ELI::NodePtr ELI::execute(const Program* program, size_t entry, const Env& sym)
+			{
+				using Op = Program::Op;
+
+				DepthGuard depth{ max_depth };
+				if (depth.exceeded) throw Recursion_too_deep{ "in compiled code" };
+
+				MachineLease lease;
+				auto& stack = lease.state->stack;
+				auto& calls = lease.state->calls;
+				auto& scopes = lease.state->scopes;
+				auto& bases = lease.state->bases;
+
+				auto pc = entry;
+				auto env = sym;
+				// keeps the function called in tail position by the outermost code alive
+				NodePtr callee;
+
+#define VM_BINARY(op, expr) case Op::op: {\
+					auto a1 = std::move(stack.back());\
+					stack.pop_back();\
+					auto& a0 = stack.back();\
+					a0 = new_atom(expr);\
+					break;\
 				}
 
-				inline bool is_token_separator()
-				{
-					return is_whitespace() || text[i] == '(' || text[i] == ')' || text[i] == '{';
+#define VM_INTEGER(op, integer, expr) case Op::op: {\
+					auto a1 = std::move(stack.back());\
+					stack.pop_back();\
+					auto& a0 = stack.back();\
+					long long x, y, r;\
+					if (integers(a0, a1, x, y) && integer(x, y, r)) a0 = new_atom(r);\
+					else a0 = new_atom(expr);\
+					break;\
 				}
 
-				inline ELI::NodePtr parse_token()
+#define VM_COMPARISON(op, operation) case Op::op: {\
+					auto a1 = std::move(stack.back());\
+					stack.pop_back();\
+					auto& a0 = stack.back();\
+					long long x, y;\
+					if (integers(a0, a1, x, y)) a0 = new_atom(x operation y);\
+					else a0 = new_atom((double)*a0 operation (double)*a1);\
+					break;\
+				}
+
+				while (true)
 				{
-					auto token_start = i;
+					auto& ins = program->code[pc++];
 
-					while (text[i] && !is_token_separator()) i++;
+					switch (ins.op)
+					{
+					case Op::Const:
+						stack.push_back(program->constants[ins.a]);
+						break;
 
-					return eli->new_atom(std::string(text + token_start, text + i));
-				}
+					case Op::Load:
+					{
+						if (env)
+						{
+							auto x = env->find(ins.a);
+							if (x)
+							{
+								stack.push_back(*x);
+								break;
+							}
+						}
 
-				inline ELI::NodePtr parse_list()
-				{
-					auto output = eli->new_list();
-					while (true)
+						auto y = global(ins.a);
+						stack.push_back(y ? std::move(y) : program->constants[ins.b]);
+						break;
+					}
+
+					case Op::Guard:
+						if (is_shadowed(ins.a, env))
+						{
+							stack.push_back(eval(program->constants[ins.b], env));
+							pc = ins.c;
+						}
+						break;
+
+					case Op::Pop:
+						stack.pop_back();
+						break;
+
+					case Op::Jump:
+						pc = ins.a;
+						break;
+
+					case Op::JumpIfNot:
 					{
-						auto element = parse();
+						auto condition = (bool)*stack.back();
+						stack.pop_back();
+						if (!condition) pc = ins.a;
+						break;
+					}
 
-						skip_whitespace();
+					case Op::Enter:
+						scopes.push_back(env);
+						env = new_frame(env);
+						break;
 
-						if (element->is_atom() && element->is_empty())
+					case Op::Bind:
+						env->bind(ins.a, std::move(stack.back()));
+						stack.pop_back();
+						break;
+
+					case Op::Leave:
+						env = std::move(scopes.back());
+						scopes.pop_back();
+						break;
+
+					case Op::Def:
+					{
+						define(ins.a, std::move(stack.back()));
+						stack.pop_back();
+						break;
+					}
+
+					case Op::MakeFn:
+					{
+						auto prototype = program->constants[ins.a]->func();
+						auto fn = make_node<Func>(*prototype);
+						if (prototype->code) fn->program = prototype->code->shared_from_this();
+						stack.push_back(fn);
+						break;
+					}
+
+					case Op::Apply:
+					{
+						auto& tree = program->constants[ins.a];
+
+						if (auto fn = stack.back()->func())
 						{
-							if (text[i] == ')') i++;
+							// a lambda: its arguments are evaluated by the code that follows
+							if (VAL_SIZE < fn->parameter_names.size() + 1)
+								throw Insufficient_arguments{ tree };
+
+							bases.push_back(stack.size() - 1);
 							break;
 						}
 
-						output->list()->push(element);
+						auto head = std::move(stack.back());
+						stack.pop_back();
 
-						if (text[i] == ')')
+						if (auto builtin = head->builtin())
 						{
-							i++;
-							break;
+							auto call_tree = tree;
+
+							if (ins.b != Program::no_template)
+							{
+								auto& t = program->templates[ins.b];
+								auto shadowed = t.fn != builtin->fn;
+
+								for (auto id : t.guards)
+									shadowed = shadowed || is_shadowed(id, env);
+
+								if (!shadowed) call_tree = Compiler::instantiate(this, t.tree, program);
+							}
+
+							stack.push_back(builtin->call(call_tree, env, this));
+						}
+						else if (head->is_func())
+						{
+							stack.push_back(head->call(tree, env, this));
 						}
+						else
+						{
+							stack.push_back(with_head(this, tree, head));
+						}
+
+						pc = ins.c;
+						break;
 					}
 
-					return output;
-				}
+					case Op::Arg:
+						if (ins.a >= stack[bases.back()]->func()->parameter_names.size()) pc = ins.b;
+						break;
 
-				ELI::NodePtr parse()
-				{
-					skip_whitespace();
+					case Op::Call:
+					{
+						auto base = bases.back();
+						bases.pop_back();
 
-					switch (text[i])
+						auto head = std::move(stack[base]);
+						auto fn = head->func();
+						auto count = fn->parameter_names.size();
+
+						// the parameters are bound in a frame of their own
+						auto frame = new_frame(env);
+						frame->bindings.reserve(count);
+
+						for (size_t i = 0; i < count; i++)
+						{
+							auto id = i < fn->parameters.size() ? fn->parameters[i] : intern(fn->parameter_names[i]);
+							frame->bind(id, std::move(stack[base + 1 + i]));
+						}
+
+						stack.resize(base);
+
+						if (fn->code)
+						{
+							// a call in tail position (followed by jumps and closing frames up to a return)
+							// replaces the frame of the current function
+							auto next = pc;
+							size_t leaves = 0;
+							while (program->code[next].op == Op::Jump || program->code[next].op == Op::Leave)
+							{
+								if (program->code[next].op == Op::Jump) next = program->code[next].a;
+								else
+								{
+									leaves++;
+									next++;
+								}
+							}
+
+							if (program->code[next].op == Op::Return)
+							{
+								scopes.resize(scopes.size() - leaves);
+								frame->skip_shadowed();
+								if (calls.empty()) callee = std::move(head);
+								else calls.back().callee = std::move(head);
+							}
+							else
+							{
+								// nested calls count towards the limit as the evaluations do
+								if (eval_depth + calls.size() >= max_depth) throw Recursion_too_deep{ "in compiled code" };
+								calls.push_back({ program, pc, std::move(env), std::move(head) });
+							}
+
+							program = fn->code;
+							pc = fn->entry;
+							env = std::move(frame);
+						}
+						else
+						{
+							stack.push_back(eval(fn->body, frame));
+						}
+						break;
+					}
+
+					case Op::Return:
 					{
-					case 0: return eli->new_atom("");
-					case '(': i++;  return parse_list();
-					case '{': i++;  return parse_comment();
-					default: return parse_token();
+						if (calls.empty())
+						{
+							auto result = std::move(stack.back());
+							return result;
+						}
+
+						auto& frame = calls.back();
+						program = frame.program;
+						pc = frame.pc;
+						env = std::move(frame.env);
+						calls.pop_back();
+						break;
+					}
+
+					case Op::Not:
+						stack.back() = new_atom(!(bool)*stack.back());
+						break;
+
+					case Op::Math:
+					{
+						auto& a0 = stack.back();
+						if (!a0->is_atom()) throw Invalid_argument{ a0 };
+						a0 = new_atom(math_functions[ins.a].fn((double)*a0));
+						break;
+					}
+
+					VM_INTEGER(Add, add_integers, (double)*a0 + (double)*a1)
+					VM_INTEGER(Sub, sub_integers, (double)*a0 - (double)*a1)
+					VM_INTEGER(Mul, mul_integers, (double)*a0 * (double)*a1)
+					VM_INTEGER(Div, div_integers, (double)*a0 / (double)*a1)
+					VM_INTEGER(Mod, mod_integers, std::fmod((double)*a0, (double)*a1))
+					VM_COMPARISON(Less, <)
+					VM_COMPARISON(Greater, >)
+					VM_COMPARISON(LessEqual, <=)
+					VM_COMPARISON(GreaterEqual, >=)
+					VM_BINARY(Equal, a0->compare(a1))
+					VM_BINARY(NotEqual, !a0->compare(a1))
+					VM_BINARY(And, (bool)*a0 && (bool)*a1)
+					VM_BINARY(Or, (bool)*a0 || (bool)*a1)
+					VM_BINARY(Xor, (((bool)*a0) && !((bool)*a1)) || (!((bool)*a0) && ((bool)*a1)))
+					VM_BINARY(Atan2, std::atan2((double)*a0, (double)*a1))
+					VM_BINARY(Pow, std::pow((double)*a1, (double)*a0))
+					VM_BINARY(Log, std::log((double)*a1) / std::log((double)*a0))
 					}
 				}
-			};
 
-			std::pair<std::string, std::string> ELI::run(const char* text)
+#undef VM_BINARY
+#undef VM_INTEGER
+#undef VM_COMPARISON
+			}
+
+			// Compile Lisp code into a bytecode program
+			ELI::ProgramPtr ELI::compile(const char* text)
 			{
 				Parser parser(this, text);
+				Compiler compiler(this);
 
-				auto tree = parser.parse();
+				compiler.compile(parser.parse_all());
+				compiler.emit(Program::Op::Return);
+				compiler.compile_pending();
 
-				try
-				{
-					auto result = eval(tree, SymbolTable{});
+				// a program may be run by several threads
+				for (auto& c : compiler.program->constants) if (c) c->share();
+				for (auto& t : compiler.program->templates) t.tree->share();
 
-					return std::make_pair(result->to_string(), "");
-				}
-				catch (Invalid_argument invarg)
-				{
-					return std::make_pair("", "Invalid argument " + invarg.message);
-				}
-				catch (Insufficient_arguments insuff)
-				{
-					return std::make_pair("", "Insufficient arguments " + insuff.message);
-				}
-				catch (Variable_not_found vnf)
-				{
-					return std::make_pair("", "External variable not found " + vnf.var);
-				}
-				catch (Write_to_readonly_variable ro)
-				{
-					return std::make_pair("", "Attempted write to read-only variable " + ro.var);
-				}
-				catch (Function_not_found fnf)
-				{
-					return std::make_pair("", "Function not found " + fnf.func);
-				}
+				return compiler.program;
+			}
+
+			// Execute a compiled program
+			std::pair<std::string, std::string> ELI::run(const ProgramPtr& program)
+			{
+				return run_guarded([&] { return execute(program.get(), 0, Env{}); });
 			}
 		}
 	}
@@ -4,11 +4,15 @@
 
 #include <string>
 #include <vector>
+#include <list>
 #include <unordered_map>
 #include <algorithm>
 #include <memory>
 #include <mutex>
+#include <atomic>
 #include <ostream>
+#include <future>
+#include <thread>
 
 namespace maxy
 {
@@ -28,17 +32,192 @@ namespace maxy
 				struct Node;
 				struct Atom;
 				struct List;
+				struct Vector;
+				struct Seq;
+				struct Dict;
+				struct Pending;
 				struct Func;
 				struct Builtin;
+				struct Frame;
+				// Compiled bytecode program
+				struct Program;
+				// Parsed script
+				struct Script;
+				// Elementwise operation of a builtin over numbers (see map and zipWith)
+				struct Kernel;
 			
+				// Intrusive reference to a tree node
+				template<typename Ty>
+				class NodeRef;
 				// Container for a tree node
-				using NodePtr = std::shared_ptr<Node>;
+				using NodePtr = NodeRef<Node>;
 				// Type for the Symbol Table 
 				using SymbolTable = std::unordered_map<std::string, NodePtr>;
+				// Container for a local environment (a chain of frames, empty at the top level)
+				using Env = std::shared_ptr<Frame>;
+				// Handle to a compiled program (it can be executed any number of times)
+				using ProgramPtr = std::shared_ptr<const Program>;
+				// Handle to a parsed script (it can be executed any number of times)
+				using ScriptPtr = std::shared_ptr<const Script>;
+				// Interned identifier
+				using SymbolId = unsigned int;
+				static constexpr SymbolId no_symbol = ~0u;
+				// Execution state of one thread over a shared interpreter
+				class Context;
+
+				// Memory hooks for the nodes and frames made by the interpreter
+				struct Allocator
+				{
+					void* (*allocate)(size_t size);
+					void (*deallocate)(void* block, size_t size);
+				};
+
+				// Standard allocator adaptor for the Allocator hooks
+				template<typename Ty>
+				struct NodeAllocator
+				{
+					using value_type = Ty;
+
+					Allocator hooks;
+
+					NodeAllocator(Allocator h) : hooks{ h } {}
+
+					template<typename Other>
+					NodeAllocator(const NodeAllocator<Other>& other) : hooks{ other.hooks } {}
+
+					Ty* allocate(size_t n) { return static_cast<Ty*>(hooks.allocate(n * sizeof(Ty))); }
+					void deallocate(Ty* block, size_t n) { hooks.deallocate(block, n * sizeof(Ty)); }
+
+					template<typename Other>
+					bool operator==(const NodeAllocator<Other>& other) const { return hooks.allocate == other.hooks.allocate && hooks.deallocate == other.hooks.deallocate; }
+
+					template<typename Other>
+					bool operator!=(const NodeAllocator<Other>& other) const { return !(*this == other); }
+				};
+
+				// Intrusive reference to a tree node. The count lives in the node and is updated
+				// with plain loads and stores while the node is owned by a single thread; nodes
+				// that other threads may reach are marked with `Node::share()` first.
+				template<typename Ty>
+				class NodeRef
+				{
+					template<typename Other>
+					friend class NodeRef;
+
+					Ty* ptr;
+
+				public:
+					NodeRef() : ptr{ nullptr } {}
+					NodeRef(std::nullptr_t) : ptr{ nullptr } {}
+					explicit NodeRef(Ty* p) : ptr{ p } { if (ptr) Node::retain(ptr); }
+					NodeRef(const NodeRef& other) : ptr{ other.ptr } { if (ptr) Node::retain(ptr); }
+					NodeRef(NodeRef&& other) noexcept : ptr{ other.ptr } { other.ptr = nullptr; }
+
+					template<typename Other>
+					NodeRef(const NodeRef<Other>& other) : ptr{ other.ptr } { if (ptr) Node::retain(ptr); }
+
+					template<typename Other>
+					NodeRef(NodeRef<Other>&& other) noexcept : ptr{ other.ptr } { other.ptr = nullptr; }
+
+					~NodeRef() { if (ptr) Node::release(ptr); }
+
+					NodeRef& operator=(NodeRef other) noexcept
+					{
+						std::swap(ptr, other.ptr);
+						return *this;
+					}
+
+					Ty* get() const { return ptr; }
+					Ty* operator->() const { return ptr; }
+					Ty& operator*() const { return *ptr; }
+					explicit operator bool() const { return ptr != nullptr; }
+
+					void reset() { NodeRef{}.swap(*this); }
+					void swap(NodeRef& other) noexcept { std::swap(ptr, other.ptr); }
+
+					template<typename Other>
+					bool operator==(const NodeRef<Other>& other) const { return ptr == other.ptr; }
+
+					template<typename Other>
+					bool operator!=(const NodeRef<Other>& other) const { return ptr != other.ptr; }
+
+					bool operator==(std::nullptr_t) const { return ptr == nullptr; }
+					bool operator!=(std::nullptr_t) const { return ptr != nullptr; }
+				};
+
+				// Elements of a list: a slice of a buffer shared by the copies and slices of the list.
+				// Copying, slicing and dropping elements at either end is O(1); a list grows in place
+				// at either end while the buffer has room there that no other list has taken.
+				class ListValues
+				{
+					struct Storage
+					{
+						NodePtr* data;
+						size_t capacity;
+						// the slots in [lo, hi) hold elements
+						std::atomic<size_t> lo;
+						std::atomic<size_t> hi;
+
+						Storage(size_t c, size_t at);
+						~Storage();
+					};
+
+					std::shared_ptr<Storage> storage;
+					size_t first;
+					size_t last;
+
+					// Take the free slot before or after the slice
+					bool claim_front();
+					bool claim_back();
+
+					// Copy the slice into a new buffer with room for `capacity` elements starting at `at`
+					void relocate(size_t capacity, size_t at);
+
+				public:
+					using value_type = NodePtr;
+					using const_iterator = const NodePtr*;
+					using iterator = const_iterator;
+
+					ListValues() : first{ 0 }, last{ 0 } {}
+
+					size_t size() const { return last - first; }
+					bool empty() const { return last == first; }
+
+					const NodePtr& operator[](size_t i) const { return storage->data[first + i]; }
+					const NodePtr& front() const { return storage->data[first]; }
+					const NodePtr& back() const { return storage->data[last - 1]; }
+
+					const_iterator begin() const { return storage ? storage->data + first : nullptr; }
+					const_iterator end() const { return storage ? storage->data + last : nullptr; }
+
+					// Replace an element (the buffer is copied first if other lists share it)
+					void set(size_t i, NodePtr value);
+
+					void push_back(NodePtr value);
+					void push_front(NodePtr value);
+
+					template<typename It>
+					void append(It from, It to)
+					{
+						for (; from != to; ++from) push_back(*from);
+					}
+
+					void reserve(size_t count);
+					void clear();
+
+					// Elements [from, to) sharing the buffer
+					ListValues slice(size_t from, size_t to) const;
+				};
+
 				// Type for the Builtin Function Pointer
-				using BuiltinFunc = NodePtr(*)(NodePtr, SymbolTable, ELI*);
+				using BuiltinFunc = NodePtr(*)(const NodePtr&, const Env&, ELI*);
+				// Type for a special form that ends with an expression in tail position (`if`, `seq`, `let`):
+				// it returns that expression unevaluated, setting `scope` if it is evaluated in a new frame
+				using TailForm = NodePtr(*)(const NodePtr& tree, const Env& sym, ELI* eli, Env& scope);
 				// The type of a function that can be registered as an External Function callable from within Lisp
 				using ExtFunc = std::vector<std::string>(*)(std::vector<std::string>);
+				// The type of an External Function that starts its work and returns the result later (see callAsync)
+				using AsyncExtFunc = std::future<std::vector<std::string>>(*)(std::vector<std::string>);
 
 				// Syntax Tree Node (abstract)
 				struct Node
@@ -47,21 +226,92 @@ namespace maxy
 					{
 						Atom,
 						List,
-						Func
+						Func,
+						Dict,
+						Pending
 					};
 
+					// Concrete class of the node. Type checks and casts compare the tag instead of using RTTI.
+					enum class Kind : unsigned char
+					{
+						Atom,
+						List,
+						Func,
+						Builtin,
+						// packed list of numbers
+						Vector,
+						// lazy sequence
+						Seq,
+						// hash map
+						Dict,
+						// result of an external call that has not been awaited
+						Pending
+					};
+
+					const Kind kind;
+
+				private:
+					template<typename Other>
+					friend class NodeRef;
+					friend class ELI;
+
+					// the node may be reachable from several threads, its count is updated atomically
+					bool shared;
+					// size of the block for `deallocate` (0 if the node was made with `new`)
+					unsigned short block_size;
+					mutable std::atomic<unsigned int> refs;
+					void (*deallocate)(void* block, size_t size);
+
+					static void retain(const Node* node)
+					{
+						if (node->shared) node->refs.fetch_add(1, std::memory_order_relaxed);
+						else node->refs.store(node->refs.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+					}
+
+					static void release(const Node* node)
+					{
+						if (node->shared)
+						{
+							if (node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) destroy(node);
+						}
+						else
+						{
+							auto n = node->refs.load(std::memory_order_relaxed) - 1;
+							node->refs.store(n, std::memory_order_relaxed);
+							if (n == 0) destroy(node);
+						}
+					}
+
+					static void destroy(const Node* node);
+
+				public:
+					Node(Kind k) : kind{ k }, shared{ false }, block_size{ 0 }, refs{ 0 }, deallocate{ nullptr } {}
+					// a copy is a new node with its own count
+					Node(const Node& other) : kind{ other.kind }, shared{ false }, block_size{ 0 }, refs{ 0 }, deallocate{ nullptr } {}
 					virtual ~Node() { }
-					virtual Type type() = 0;
+
+					// Mark the node and everything it refers to as reachable from several threads
+					// (call it before publishing the node, e.g. in a global)
+					void share();
+					bool is_shared() const { return shared; }
+
+					Type type() const { return kind == Kind::Atom ? Type::Atom : is_list() ? Type::List : kind == Kind::Dict ? Type::Dict : kind == Kind::Pending ? Type::Pending : Type::Func; }
+					bool is_list() const { return kind == Kind::List || kind == Kind::Vector || kind == Kind::Seq; }
+					bool is_atom() const { return kind == Kind::Atom; }
+					bool is_func() const { return kind == Kind::Func || kind == Kind::Builtin; }
+
 					virtual bool is_empty() = 0;
-					virtual bool is_list() = 0;
-					virtual bool is_atom() = 0;
-					virtual bool is_func() = 0;
 					virtual operator bool() = 0;
 					virtual operator double() = 0;
-					virtual NodePtr call(NodePtr tree, SymbolTable sym, ELI * eli) = 0;
+					virtual NodePtr call(const NodePtr& tree, const Env& sym, ELI * eli) = 0;
 
 					Atom* atom();
+					// a List, or the elements of a Vector or a Seq as a List (made once)
 					List* list();
+					Vector* vector();
+					Seq* seq();
+					Dict* dict();
+					Pending* pending();
 					Func* func();
 					Builtin* builtin();
 
@@ -70,85 +320,283 @@ namespace maxy
 					bool compare(NodePtr other);
 
 					std::string to_string(void);
+
+				private:
+					// The elements of a Vector or a Seq as a List (nullptr for the other kinds)
+					List* elements();
 				};
 
 				// Atom node
+				// An atom keeps both its text and its numeric value. Atoms produced by arithmetic
+				// only hold the number, the text is made from it on output.
 				struct Atom : Node
 				{
 					std::string value;
-					Atom() : value{ "" } {}
-					Atom(std::string v) : value{ v } {}
+					double number;
+					// `number` is the exact value of the atom (the whole text is a number)
+					bool numeric;
+					// `value` holds the text of the atom
+					bool textual;
+					// `integer` is the exact value of the atom (a whole number that fits into 64 bits)
+					bool integral;
+					long long integer;
+					// interned id of the identifier (set by the parser)
+					SymbolId symbol;
+
+					Atom() : Node{ Kind::Atom }, value{ "" }, number{ 0.0 }, numeric{ false }, textual{ true }, integral{ false }, integer{ 0 }, symbol{ no_symbol } {}
+					Atom(std::string v);
+					Atom(std::string v, double d) : Node{ Kind::Atom }, value{ v }, number{ d }, numeric{ true }, textual{ true }, integral{ false }, integer{ 0 }, symbol{ no_symbol } {}
+					Atom(double d);
+					Atom(long long i) : Node{ Kind::Atom }, number{ (double)i }, numeric{ true }, textual{ false }, integral{ true }, integer{ i }, symbol{ no_symbol } {}
+					Atom(const Atom& other) : Node{ other }, value{ other.value }, number{ other.number }, numeric{ other.numeric }, textual{ other.textual }, integral{ other.integral }, integer{ other.integer }, symbol{ other.symbol } {}
 
 					virtual ~Atom() {}
-					virtual Type type() { return Type::Atom; }
-					virtual bool is_empty() { return value == ""; }
-					virtual bool is_list() { return false; }
-					virtual bool is_atom() { return true; }
-					virtual bool is_func() { return false; }
+					virtual bool is_empty() { return textual && value.empty(); }
 					virtual void output(std::ostream& os);
 					virtual operator bool();
-					virtual operator double();
-					virtual NodePtr call(NodePtr tree, SymbolTable, ELI *) { return tree; }
+					virtual operator double() { return number; }
+					virtual NodePtr call(const NodePtr& tree, const Env&, ELI *) { return tree; }
+
+					// Format a number the way Lisp prints it
+					static std::string number_to_string(double d);
 				};
 
 				// List node
 				struct List : Node
 				{
-					std::vector<ELI::NodePtr> values;
+					ListValues values;
 
-					List() {}
+					List() : Node{ Kind::List } {}
 
 					virtual ~List() {}
 
-					virtual Type type() { return Type::List; }
 					virtual bool is_empty() { return values.size() == 0; }
-					virtual bool is_list() { return true; }
-					virtual bool is_atom() { return false; }
-					virtual bool is_func() { return false; }
 					virtual void output(std::ostream& os);
 					virtual operator bool();
 					virtual operator double() { return 0.0L; }
-					virtual NodePtr call(NodePtr tree, SymbolTable, ELI *) { return tree; }
+					virtual NodePtr call(const NodePtr& tree, const Env&, ELI *) { return tree; }
 
 					void push(NodePtr node) { values.push_back(node); }
 				};
 
+				// Vector node: a list of numbers packed into a buffer shared with the slices of the vector
+				struct Vector : Node
+				{
+					std::shared_ptr<const std::vector<double>> buffer;
+					// the elements are [first, last) of the buffer
+					size_t first;
+					size_t last;
+					// the atoms of the elements for the code that reads them as a list
+					std::once_flag unpack_once;
+					NodePtr unpacked_list;
+
+					Vector(std::vector<double> numbers) : Node{ Kind::Vector }, buffer{ std::make_shared<const std::vector<double>>(std::move(numbers)) }, first{ 0 }, last{ buffer->size() } {}
+					Vector(std::shared_ptr<const std::vector<double>> b, size_t f, size_t l) : Node{ Kind::Vector }, buffer{ std::move(b) }, first{ f }, last{ l } {}
+
+					virtual ~Vector() {}
+
+					// The numbers as a List of atoms, made on the first call (see Node::list)
+					List* unpacked();
+
+					size_t size() const { return last - first; }
+					double operator[](size_t i) const { return (*buffer)[first + i]; }
+					const double* begin() const { return buffer->data() + first; }
+					const double* end() const { return buffer->data() + last; }
+
+					virtual bool is_empty() { return last == first; }
+					virtual void output(std::ostream& os);
+					virtual operator bool() { return last != first; }
+					virtual operator double() { return 0.0L; }
+					virtual NodePtr call(const NodePtr& tree, const Env&, ELI *) { return tree; }
+				};
+
+				// Seq node: a lazy sequence. The elements of the source are passed through the stages
+				// one at a time as they are pulled, strict consumers see the list made by `force()`.
+				struct Seq : Node
+				{
+					struct Stage
+					{
+						enum class Op : unsigned char
+						{
+							Map,
+							Filter,
+							TakeWhile,
+							DropWhile,
+							Take,
+							Drop
+						};
+
+						Op op;
+						// the function of the stage and the scope it is called in
+						NodePtr fn;
+						Env scope;
+						// the number of elements for Take and Drop
+						size_t count;
+					};
+
+					// Pulls the elements of a sequence one at a time
+					class Cursor;
+
+					ELI* eli;
+					// the source: the elements of `values` (the numbers [0, count) if it is null),
+					// or `zip` applied to the elements of `values` and `other`
+					NodePtr values;
+					NodePtr other;
+					NodePtr zip;
+					Env zip_scope;
+					size_t count;
+					std::vector<Stage> stages;
+					// the elements, once something needed all of them
+					NodePtr forced;
+
+					Seq(ELI* e) : Node{ Kind::Seq }, eli{ e }, count{ 0 } {}
+
+					virtual ~Seq() {}
+
+					// All the elements as a list or a vector (they are made once)
+					const NodePtr& force();
+					// The elements are made without calling functions (only Take and Drop over a plain source)
+					bool is_plain() const;
+					void release_source();
+
+					virtual bool is_empty();
+					virtual void output(std::ostream& os) { force()->output(os); }
+					virtual operator bool() { return !is_empty(); }
+					virtual operator double() { return 0.0L; }
+					virtual NodePtr call(const NodePtr& tree, const Env&, ELI *) { return tree; }
+				};
+
+				// Dict node: a persistent hash map from atoms (compared by their text) to values.
+				// A changed dict is a new node that shares all but the changed path of the trie
+				// with the old one; the keys and values are shared when they are put in.
+				struct Dict : Node
+				{
+					// node of the hash array mapped trie (immutable once it is in a dict)
+					struct Trie;
+
+					std::shared_ptr<const Trie> root;
+					size_t count;
+
+					Dict() : Node{ Kind::Dict }, count{ 0 } {}
+					Dict(const Dict& other) : Node{ other }, root{ other.root }, count{ other.count } {}
+
+					virtual ~Dict() {}
+
+					// Find the value of a key (nullptr if there is none)
+					const NodePtr* find(const std::string& key) const;
+					// Set the value of a key
+					void insert(const NodePtr& key, const NodePtr& value);
+					// Remove a key (false if there is none)
+					bool remove(const std::string& key);
+					// The keys and their values ordered by the keys
+					std::vector<std::pair<NodePtr, NodePtr>> entries() const;
+
+					virtual bool is_empty() { return count == 0; }
+					virtual void output(std::ostream& os);
+					virtual operator bool() { return count != 0; }
+					virtual operator double() { return 0.0L; }
+					virtual NodePtr call(const NodePtr& tree, const Env&, ELI *) { return tree; }
+				};
+
+				// Pending node: the result of an external function started by `callAsync`, `await` waits for it
+				struct Pending : Node
+				{
+					std::shared_future<std::vector<std::string>> result;
+
+					Pending(std::shared_future<std::vector<std::string>> r) : Node{ Kind::Pending }, result{ std::move(r) } {}
+					virtual ~Pending() {}
+
+					virtual bool is_empty() { return false; }
+					virtual void output(std::ostream& os) { os << "<pending>"; }
+					virtual operator bool() { return true; }
+					virtual operator double() { return 0.0L; }
+					virtual NodePtr call(const NodePtr& tree, const Env&, ELI *) { return tree; }
+				};
+
 				// Func node
 				struct Func : Node
 				{
 					std::vector<std::string> parameter_names;
+					std::vector<SymbolId> parameters;
 					NodePtr body;
 					std::unordered_map<std::string, NodePtr> symbols;
+					// compiled body (set for functions made by compiled code)
+					const Program* code;
+					size_t entry;
+					// keeps `code` alive (empty for the prototypes owned by the program itself)
+					ProgramPtr program;
 
-					Func() : body{ NodePtr(nullptr) } {}
+					Func() : Node{ Kind::Func }, body{ NodePtr(nullptr) }, code{ nullptr }, entry{ 0 } {}
 					virtual ~Func() {}
 
-					virtual Type type() { return Type::Func; }
 					virtual bool is_empty() { return body == nullptr || body->is_empty(); }
-					virtual bool is_list() { return false; }
-					virtual bool is_atom() { return false; }
-					virtual bool is_func() { return true; }
 					virtual void output(std::ostream& os) { os << "<fn>"; }
 					virtual operator bool() { return true; }
 					virtual operator double() { return 0.0L; }
-					virtual NodePtr call(NodePtr tree, SymbolTable sym, ELI * eli);
+					virtual NodePtr call(const NodePtr& tree, const Env& sym, ELI * eli);
+
+					// Evaluate the arguments and bind them in a new frame on top of the caller's scope
+					Env enter(const NodePtr& tree, const Env& sym, ELI * eli);
+
+					// Call with arguments that are already evaluated (at least one per parameter)
+					NodePtr apply(const NodePtr* args, const Env& sym, ELI * eli);
 				};
 
 				struct Builtin : Node
 				{
 					std::string name;
 					BuiltinFunc fn;
-					Builtin(std::string s, BuiltinFunc f) : name{ s }, fn{ f } {};
+					// the tail position of the form is evaluated without nesting (nullptr for other builtins)
+					TailForm tail;
+					Builtin(std::string s, BuiltinFunc f, TailForm t = nullptr) : Node{ Kind::Builtin }, name{ s }, fn{ f }, tail{ t } {};
 					virtual ~Builtin() {}
-					virtual Type type() { return Type::Func; }
 					virtual bool is_empty() { return false; }
-					virtual bool is_list() { return false; }
-					virtual bool is_atom() { return false; }
-					virtual bool is_func() { return true; }
 					virtual void output(std::ostream& os) { os << name; }
 					virtual operator bool() { return true; }
 					virtual operator double() { return 0.0L; }
-					virtual NodePtr call(NodePtr tree, SymbolTable sym, ELI * eli);
+					virtual NodePtr call(const NodePtr& tree, const Env& sym, ELI * eli);
+				};
+
+				// Local environment frame: the bindings made by a single call or `let`,
+				// linked to the frame of the enclosing scope
+				struct Frame
+				{
+					Env parent;
+					// bloom filter of the names bound in this frame and all of its parents
+					unsigned long long mask;
+					std::vector<std::pair<SymbolId, NodePtr>, NodeAllocator<std::pair<SymbolId, NodePtr>>> bindings;
+
+					Frame(Env p, Allocator a) : parent{ p }, mask{ p ? p->mask : 0 }, bindings{ NodeAllocator<std::pair<SymbolId, NodePtr>>(a) } {}
+					~Frame();
+
+					// Bind a name in this frame (replaces an existing binding of the same frame)
+					void bind(SymbolId name, NodePtr value);
+
+					// Find the innermost binding of a name in the chain starting at this frame
+					const NodePtr* find(SymbolId name) const;
+
+					// Unlink the parent frames whose bindings are all rebound by this frame (they cannot be seen)
+					void skip_shadowed();
+
+					static unsigned long long name_bit(SymbolId name)
+					{
+						return 1ull << (name & 63);
+					}
+				};
+
+				// Parsed script
+				struct Script
+				{
+					NodePtr tree;
+				};
+
+				// Statistics of the cache of parsed scripts used by `run(text)`
+				struct CacheStats
+				{
+					unsigned long long hits;
+					unsigned long long misses;
+					size_t size;
+					size_t capacity;
 				};
 
 			private:
@@ -190,12 +638,30 @@ namespace maxy
 					ExtVar(volatile bool* ptr, size_t comp = 1, bool ro = false) : bptr{ ptr }, type{ Type::Bool }, components{ comp }, readonly{ ro } {};
 				};
 
+				// Immutable version of the global symbol table indexed by symbol id
+				struct Globals;
+
+				// Holds the version of the globals read by the code running on this thread
+				class GlobalsLease;
+
+				// Interned identifiers, read without locking
+				struct Symbols;
+
+				// Bytecode compiler
+				struct Compiler;
+
+				// Applies a function to arguments that are already evaluated (see map, filter and the folds)
+				struct Applier;
+
 				// exceptions
 				struct Invalid_argument;
 				struct Insufficient_arguments;
 				struct Variable_not_found;
 				struct Write_to_readonly_variable;
 				struct Function_not_found;
+				struct Recursion_too_deep;
+				struct Symbol_table_full;
+				struct Image_in_use;
 
 				// Registered external variables
 				std::unordered_map<std::string, ExtVar> variables;
@@ -203,15 +669,166 @@ namespace maxy
 				// Registered external functions
 				std::unordered_map<std::string, ExtFunc> functions;
 
+				// Registered asynchronous external functions
+				std::unordered_map<std::string, AsyncExtFunc> async_functions;
+
 				// Builtin functions
 				std::unordered_map<std::string, BuiltinFunc> builtins;
 
-				// Global symbol table
-				SymbolTable symbols;
+				// Tail positions of the special forms
+				std::unordered_map<std::string, TailForm> tail_forms;
+
+				// Builtin functions indexed by symbol id
+				std::vector<BuiltinFunc> builtin_table;
+
+				// Prebuilt Builtin nodes indexed by symbol id
+				std::vector<NodePtr> builtin_nodes;
+
+				// Elementwise kernels of the builtins
+				std::unordered_map<BuiltinFunc, const Kernel*> kernels;
+
+				// Get the kernel of a builtin node (nullptr for other nodes)
+				const Kernel* find_kernel(const NodePtr& fn);
+
+				// Order of two values for sort, binarySearch, unique, minimum and maximum (-1, 0 or 1)
+				int order(Node* a, Node* b);
+
+				// Sort the positions of the keys by their order (stable, in parallel for many atoms)
+				void sort_positions(std::vector<size_t>& positions, const ListValues& keys);
+
+				// Number of elements from which sorting runs on several threads (0 never does)
+				size_t parallel_sort_threshold;
+
+				// Stable sort, split between the pool and this thread from parallel_sort_threshold elements
+				template<typename It, typename Less>
+				void parallel_sort(It first, It last, Less less);
+
+				// Work-stealing pool running the chunks of pmap, pfilter and preduce (see set_thread_pool)
+				class ThreadPool;
+				std::unique_ptr<ThreadPool> thread_pool;
+
+				// Number of elements from which pmap, pfilter and preduce use the pool
+				size_t parallel_threshold;
+
+				// Wait for the result of an external call, running the tasks of the pool meanwhile
+				std::vector<std::string> await_result(const Pending* pending);
+
+				// Call `body(from, to)` for the chunks of [0, count) on the pool and this thread,
+				// the workers read the globals of the calling run; rethrows the error of the first failing chunk
+				template<typename Body>
+				void parallel_for(size_t count, Body body);
+
+				// Call `body(apply, from, to)` for the chunks of [0, count), on the pool if there are enough
+				// elements; `apply` applies `fn` in `scope`, `input` holds the elements the chunks read
+				template<typename Body>
+				void parallel_chunks(const NodePtr& fn, const Env& scope, size_t arity, const NodePtr& input, size_t count, Body body);
+
+				// Call `item(i)` for the items of a batch (on the pool if there is one),
+				// every item reads the globals as they were when the batch started
+				template<typename Item>
+				void run_items(size_t count, Item item);
+
+				// Interned identifiers
+				std::unique_ptr<Symbols> symbol_ids;
+
+				// a mutex for interning identifiers
+				std::mutex intern_mutex;
+
+				// Current version of the global symbol table: `def` publishes a new one, a run keeps
+				// reading the version it started with (and the versions published by its own `def`s)
+				std::atomic<Globals*> globals;
+
+				// Readers between loading `globals` and counting themselves in (see acquire_globals)
+				std::atomic<size_t> globals_entering;
+
+				// Replaced versions that may still be read
+				std::vector<Globals*> retired_globals;
 
 				// a mutex for thread-safe execution of `def` operations
 				std::mutex symbol_mutex;
 
+				// Take and give back a reference to the current version (never blocks)
+				Globals* acquire_globals();
+				void release_globals(Globals* g);
+
+				// Free the replaced versions nobody reads (symbol_mutex must be held)
+				void reclaim_globals();
+
+				// Get the global value of a name (null if it has none)
+				NodePtr global(SymbolId id);
+
+				// Store a global value
+				void define(SymbolId id, NodePtr value);
+
+				// Maximum nesting of evaluations on a thread
+				size_t max_depth;
+
+				// Look a name up
+				NodePtr resolve(const NodePtr& tree, const Env& sym);
+
+				// Allocator for the nodes and frames
+				Allocator allocator;
+
+				// Allocator for the nodes and frames made on this thread (the one of the running context)
+				const Allocator& current_allocator() const;
+
+				// Allocate a node
+				template<typename Ty, typename... Args>
+				NodeRef<Ty> make_node(Args&&... args);
+
+				// Create a new local frame on top of the given environment
+				Env new_frame(const Env& parent);
+
+				// Parsed script kept by the script cache: the tree is private to the thread that parsed it,
+				// the other threads get a copy parsed again and shared the first time they run the text
+				struct CachedScript
+				{
+					unsigned long long hash;
+					std::string text;
+					std::thread::id owner;
+					ScriptPtr script;
+					ScriptPtr shared;
+				};
+
+				// Scripts recently run by text, the most recently used first
+				std::list<CachedScript> cached_scripts;
+
+				// Cached scripts by text hash
+				std::unordered_map<unsigned long long, std::list<CachedScript>::iterator> script_index;
+
+				// Maximum number of cached scripts
+				size_t script_cache_capacity;
+
+				// Script cache counters
+				std::atomic<unsigned long long> script_cache_hits;
+				std::atomic<unsigned long long> script_cache_misses;
+
+				// a mutex for the script cache
+				std::mutex script_cache_mutex;
+
+				// Contexts reading this interpreter: its registries and settings stay as they are while there are any
+				std::atomic<size_t> contexts;
+
+				// Throw Image_in_use (a std::logic_error) if a context exists
+				void ensure_mutable(const char* what);
+
+				// Get a parsed script for the text from the cache, parsing it on a miss
+				// (`shared` if other threads run it too)
+				ScriptPtr cached_script(const char* text, bool shared = false);
+
+				// Parse Lisp code into a script run by this thread only
+				ScriptPtr parse_script(const char* text);
+
+				// Check if a builtin name is bound to something else in the given scope
+				bool is_shadowed(SymbolId id, const Env& sym);
+
+				// Execute compiled code starting at the given entry point
+				NodePtr execute(const Program* program, size_t entry, const Env& sym);
+
+				// Run a piece of evaluation converting Lisp errors into the error message
+				template<typename Fn>
+				std::pair<std::string, std::string> run_guarded(Fn fn);
+
 			public:
 
 				// PUBLIC INTERFACE:
@@ -240,21 +857,63 @@ namespace maxy
 				// Create a new List node from a vector of strings (the strings are converted to Atoms)
 				NodePtr new_list(std::vector<std::string> s);
 
+				// Create a new Vector node
+				NodePtr new_vector(std::vector<double> numbers);
+
+				// Create a new Vector node sharing the buffer of a vector
+				NodePtr new_vector(const Vector& source, size_t from, size_t to);
+
+				// Create a new (empty) Seq node
+				NodePtr new_seq();
+
+				// Create a new (empty) Dict node
+				NodePtr new_dict();
+
+				// Create a new Dict node holding the same entries as a dict
+				NodePtr new_dict(const Dict& source);
+
+				// Create a new Pending node for the result of an external call
+				NodePtr new_pending(std::shared_future<std::vector<std::string>> result);
+
 				// Create a new Func node
 				NodePtr new_func();
 
 				// Create a new Builtin node
 				NodePtr new_builtin(std::string name, BuiltinFunc fn);
 
+				// Allocator using thread-local pools of fixed-size blocks (the default)
+				static const Allocator pool_allocator;
+
+				// Allocator using the global operator new
+				static const Allocator heap_allocator;
+
+				// Set the allocator for the nodes and frames (call it before running any code)
+				void set_allocator(Allocator a);
+
+				// Set the maximum nesting of evaluations (calls in tail position do not nest),
+				// deeper code fails with an error instead of overflowing the native stack
+				void set_max_depth(size_t depth);
+
+				// Set the number of elements from which `sort` and `sortBy` run on several threads (0 disables it)
+				void set_parallel_sort_threshold(size_t count);
+
+				// Start a pool of worker threads for `pmap`, `pfilter` and `preduce` (0 stops it,
+				// call it before running any code); without a pool they run on the calling thread
+				void set_thread_pool(size_t threads);
+
+				// Set the number of elements from which `pmap`, `pfilter` and `preduce` split the work between the threads
+				void set_parallel_threshold(size_t count);
+
 				// The Interpreter Constructor
 				ELI();
 
-				~ELI() = default;
+				~ELI();
 
 				// Register an application variable to be accessible from Lisp
 				template<typename Ty>
 				void var(const char* name, volatile Ty* ptr, size_t components = 1, bool readonly = false)
 				{
+					ensure_mutable("register a variable");
 					variables[name] = ExtVar{ ptr, components, readonly };
 				}
 
@@ -267,12 +926,125 @@ namespace maxy
 				// Register an External Function
 				void func(const char* name, ExtFunc p);
 
+				// Register an External Function that returns its result through a future (see callAsync)
+				void func_async(const char* name, AsyncExtFunc p);
+
+				// Get the id of an identifier, interning it if it is new (only the names that get bound are interned)
+				SymbolId intern(const std::string& name);
+
+				// Get the id of an identifier if it has been interned (does not lock)
+				SymbolId find_symbol(const std::string& name);
+
 				// Evaluate a given Syntax Tree producing a new Node
-				NodePtr eval(NodePtr tree, SymbolTable sym);
+				NodePtr eval(const NodePtr& tree, const Env& sym);
 
-				// Execute Lisp code
+				// Execute Lisp code (the parsed code is kept in the script cache)
 				std::pair<std::string, std::string> run(const char* text);
+
+				// Parse Lisp code so that it can be run many times
+				ScriptPtr prepare(const char* text);
+
+				// Execute a parsed script
+				std::pair<std::string, std::string> run(const ScriptPtr& script);
+
+				// Set the number of scripts kept parsed by `run(text)` (0 disables the cache)
+				void set_cache_capacity(size_t capacity);
+
+				// Get the script cache statistics
+				CacheStats cache_stats();
+
+				// Compile Lisp code into a bytecode program
+				ProgramPtr compile(const char* text);
+
+				// Execute a compiled program
+				std::pair<std::string, std::string> run(const ProgramPtr& program);
+
+				// Names bound to values for one run of a batch
+				using Bindings = std::vector<std::pair<std::string, NodePtr>>;
+
+				// Execute Lisp code once for every set of bindings (on the thread pool if there is one),
+				// the results are in the order of the inputs
+				std::vector<std::pair<std::string, std::string>> run_batch(const char* text, const std::vector<Bindings>& inputs);
+
+				// Execute a parsed script once for every set of bindings
+				std::vector<std::pair<std::string, std::string>> run_batch(const ScriptPtr& script, const std::vector<Bindings>& inputs);
+
+				// Execute several parsed scripts, the results are in the order of the scripts
+				std::vector<std::pair<std::string, std::string>> run_batch(const std::vector<ScriptPtr>& scripts);
+			};
+
+			/**
+			* Execution context of one thread over an interpreter shared by many (the image).
+			* The image holds the builtins, the registered variables and functions and the library definitions;
+			* a context reads the globals of the image as they were when it was made (or refreshed), and its own
+			* `def`s stay private to it until they are merged into the image. A context is used by one thread
+			* at a time and must not outlive its image.
+			*/
+			class ELI::Context
+			{
+				friend class ELI;
+
+				ELI* image;
+
+				// Version of the globals read by the runs of this context (with its own definitions)
+				Globals* overlay;
+
+				// Names defined by this context
+				std::vector<SymbolId> defined;
+
+				// Allocator for the nodes and frames made by the runs
+				Allocator allocator;
+
+				unsigned long long runs;
+				unsigned long long failures;
+
+			public:
+				// Context counters
+				struct Stats
+				{
+					unsigned long long runs;
+					unsigned long long failures;
+					size_t definitions;
+				};
+
+				explicit Context(ELI& image);
+				~Context();
+
+				Context(const Context&) = delete;
+				Context& operator=(const Context&) = delete;
+
+				// Set the allocator for the nodes and frames made by the runs of this context
+				void set_allocator(Allocator a);
+
+				// Execute Lisp code (the parsed code is kept in the script cache of the image)
+				std::pair<std::string, std::string> run(const char* text);
+
+				// Execute a parsed script
+				std::pair<std::string, std::string> run(const ScriptPtr& script);
+
+				// Execute a compiled program
+				std::pair<std::string, std::string> run(const ProgramPtr& program);
+
+				// Read the current globals of the image, keeping the definitions of this context (call it between runs)
+				void refresh();
+
+				// Publish the values this context defined for the given names to the image,
+				// return the number of names merged (the names the context did not define are skipped)
+				size_t merge(const std::vector<std::string>& names);
+
+				// Get the context counters
+				Stats stats() const;
 			};
+
+			// Node casts (nullptr if the node is of another kind; a packed vector and a lazy sequence are lists too)
+			inline ELI::Atom* ELI::Node::atom() { return kind == Kind::Atom ? static_cast<Atom*>(this) : nullptr; }
+			inline ELI::List* ELI::Node::list() { return kind == Kind::List ? static_cast<List*>(this) : elements(); }
+			inline ELI::Vector* ELI::Node::vector() { return kind == Kind::Vector ? static_cast<Vector*>(this) : nullptr; }
+			inline ELI::Seq* ELI::Node::seq() { return kind == Kind::Seq ? static_cast<Seq*>(this) : nullptr; }
+			inline ELI::Dict* ELI::Node::dict() { return kind == Kind::Dict ? static_cast<Dict*>(this) : nullptr; }
+			inline ELI::Pending* ELI::Node::pending() { return kind == Kind::Pending ? static_cast<Pending*>(this) : nullptr; }
+			inline ELI::Func* ELI::Node::func() { return kind == Kind::Func ? static_cast<Func*>(this) : nullptr; }
+			inline ELI::Builtin* ELI::Node::builtin() { return kind == Kind::Builtin ? static_cast<Builtin*>(this) : nullptr; }
 		}
 	}
 }
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <thread>
+#include <stdexcept>
 
 #include "eli.h"
 
@@ -38,6 +39,8 @@ void test_classes()
 		std::make_tuple("non-empty list", list, false, false, true, false),
 		std::make_tuple("empty func", eli->new_func(), true, false, false, true),
 		std::make_tuple("non-empty func", func, false, false, false, true),
+		std::make_tuple("empty vector", eli->new_vector({}), true, false, true, false),
+		std::make_tuple("non-empty vector", eli->new_vector({ 1.0, 2.5 }), false, false, true, false),
 	};
 
 	auto count = 0, failed = 0;
@@ -70,12 +73,29 @@ void test_classes()
 		if (failure) failed++;
 	}
 
+	// a packed vector reads as a list of atoms
+	auto numbers = eli->eval(eli->new_list({ "iota", "4" }), nullptr);
+	count++;
+	if (!numbers->list() || numbers->list()->values.size() != 4 || numbers->list()->values[3]->to_string() != "3")
+	{
+		std::cout << "vector: list failed\n";
+		failed++;
+	}
+
+	auto window = eli->new_vector(*numbers->vector(), 1, 3);
+	count++;
+	if (!window->list() || window->list()->values.size() != 2 || window->list()->values[0]->to_string() != "1")
+	{
+		std::cout << "vector slice: list failed\n";
+		failed++;
+	}
+
 	std::cout << "-----------------------------\n" << count << " TESTS, " << failed << " FAILURES\n\n";
 }
 
-void test_basic_functions()
+void test_basic_functions(bool compiled)
 {
-	std::cout << "\n\nTesting builtin functions\n";
+	std::cout << "\n\nTesting builtin functions" << (compiled ? " (compiled)" : "") << "\n";
 
 	std::vector<std::vector<const char *>> test_cases =
 	{
@@ -125,9 +145,15 @@ void test_basic_functions()
 		{"(let x 42)", "", "Insufficient arguments (let x 42)"},
 		{"(let x 666 x)", "666", ""},
 		{"(let x 1 y 2 (+ x y))", "3", ""},
+		{"(let x 1 x (+ x 1) x)", "2", ""},
+		{"(let x 1 (let x 2 x))", "2", ""},
+		{"(let y 5 (map (fn x (+ x y)) (1 2)))", "(6 7)", ""},
+		{"(let f (fn n (if (= n 0) 0 (+ n (f (- n 1))))) (f 4))", "10", ""},
 		{"(def x)", "", "Insufficient arguments (def x)"},
 		{"(def x 1)", "", ""},
 		{"(seq (def x 41) (+ x 1))", "42", ""},
+		{"(seq (def f (fn x (* x 2))) (map f (1 2 3)))", "(2 4 6)", ""},
+		{"(seq (def + -) (+ 5 3))", "2", ""},
 
 		// operations
 		{"(! 0)", "1", ""},
@@ -226,6 +252,17 @@ void test_basic_functions()
 		{"(= () ())", "1", ""},
 		{"(= (1 2) (3 4))", "", ""},
 		{"(= (1 2) (1 2))", "1", ""},
+		{"(= (+ 1 2) 3)", "1", ""},
+		{"(= (+ 0.1 0.2) 0.3)", "1", ""},
+		{"(= (/ 0 0) (/ 0 0))", "1", ""},
+		{"(= (+ 1 2) x)", "", ""},
+		{"(= 1 1.0)", "", ""},
+		{"(= 1.0 1.0)", "1", ""},
+		{"(= (+ 0.5 0.5) 1)", "1", ""},
+		{"(= (+ 0.5 0.5) 1.0)", "", ""},
+		{"(= (- 0 0.0) 0)", "1", ""},
+		{"(= 05 (+ 2 3))", "", ""},
+		{"(seq (def inf 1 nan 2 0x1f 3) (+ inf (+ nan 0x1f)))", "6", ""},
 		{"(!= 0)", "", "Insufficient arguments (!= 0)" },
 		{"(!= 0 0)", "", "" },
 		{"(!= 0 ())", "1", "" },
@@ -246,6 +283,8 @@ void test_basic_functions()
 		{"(sqrt 1)", "1", "" },
 		{"(sqrt 4)", "2", "" },
 		{"(sqrt -1)", "nan", "" },
+		{"(sqrt 2435)", "49.345719165901308", "" },
+		{"(map sqrt (val 2435))", "(49.345719165901308)", "" },
 		{"(abs ())", "", "Invalid argument ()" },
 		{"(abs +)", "", "Invalid argument +" },
 		{"(abs 0)", "0", "" },
@@ -353,6 +392,23 @@ void test_basic_functions()
 		{"(drop 2 ())", "()", "" },
 		{"(drop 2 (1 2 3 4))", "(3 4)", "" },
 		{"(drop 5 (1 2 3 4))", "()", "" },
+		{"(seq (def a (1 2 3)) (def b (cons 0 a)) (def c (cons 9 a)) (cons b (cons c (cons a ()))))", "((0 1 2 3) (9 1 2 3) (1 2 3))", "" },
+		{"(seq (def a (iota 5)) (def b (take 2 a)) (def c (concat b (7))) (def d (concat b (8))) (cons a (cons c (cons d ()))))", "((0 1 2 3 4) (0 1 7) (0 1 8))", "" },
+		{"(seq (def a (drop 1 (1 2 3))) (def b (cons 0 a)) (def c (cons 9 (tail b))) (cons b (cons c ())))", "((0 2 3) (9 2 3))", "" },
+		{"(reverse (iota 4))", "(3 2 1 0)", "" },
+		{"(take 2 (drop 1 (iota 5)))", "(1 2)", "" },
+		{"(head (tail (iota 3)))", "1", "" },
+		{"(length (tail (iota 5)))", "4", "" },
+		{"(concat (iota 2) (5 6))", "(0 1 5 6)", "" },
+		{"(concat (iota 2) (a b))", "(0 1 a b)", "" },
+		{"(= (iota 3) (0 1 2))", "1", "" },
+		{"(= (0 1 2) (iota 3))", "1", "" },
+		{"(= (iota 3) (0 1 x))", "", "" },
+		{"(list (iota 2))", "1", "" },
+		{"(repeat 3 7)", "(7 7 7)", "" },
+		{"(repeat 2 1.50)", "(1.50 1.50)", "" },
+		{"(cons 5 (iota 2))", "(5 0 1)", "" },
+		{"(foldl (fn a x (concat a (x))) (iota 1) (iota 3))", "(0 0 1 2)", "" },
 		{"(map ())", "", "Insufficient arguments (map ())" },
 		{"(map () (123 456))", "", "Invalid argument ()" },
 		{"(map 666 (123 456))", "", "Invalid argument 666" },
@@ -374,6 +430,125 @@ void test_basic_functions()
 		{"(zipWith + 2 3)", "", "Invalid argument 2" },
 		{"(zipWith + (2) (3))", "(5)", "" },
 		{"(zipWith * (iota 4) (iota 4))", "(0 1 4 9)", "" },
+		{"(zipWith - (iota 9) (repeat 7 2))", "(-2 -1 0 1 2 3 4)", "" },
+		{"(zipWith / (iota 5) (1 2 4 8 16))", "(0 0.5 0.5 0.375 0.25)", "" },
+		{"(zipWith < (iota 6) (repeat 6 2.5))", "(1 1 1   )", "" },
+		{"(zipWith = (iota 3) (0 5 2))", "(1  1)", "" },
+		{"(zipWith pow (repeat 3 2) (iota 3))", "(0 1 4)", "" },
+		{"(zipWith + (iota 3) (1 x 2))", "(1 1 4)", "" },
+		{"(map sqrt (iota 10))", "(0 1 1.414213562373095 1.732050807568877 2 2.23606797749979 2.449489742783178 2.645751311064591 2.82842712474619 3)", "" },
+		{"(= (map sin (iota 9)) (map (fn x (sin x)) (iota 9)))", "1", "" },
+		{"(= (map sqrt (iota 99)) (map (fn x (sqrt x)) (iota 99)))", "1", "" },
+		{"(map abs (-1.5 2 -3))", "(1.5 2 3)", "" },
+		{"(map floor (zipWith / (iota 7) (repeat 7 2)))", "(0 0 1 1 2 2 3)", "" },
+		{"(map ! (0 1 0))", "(1  1)", "" },
+		{"(seq (def pairs ((p 1) (q 2)) p 5 q 6) (map head pairs))", "(p q)", "" },
+		{"(seq (def keys (r s) r 5) (zipWith cons keys (() ())))", "((r) (s))", "" },
+		{"(map + (1 2))", "", "Insufficient arguments (+ 1)" },
+		{"(take 10 (filter (fn x (= 0 (% x 7))) (map (fn x (* x 3)) (iota 1000000))))", "(0 21 42 63 84 105 126 147 168 189)", "" },
+		{"(take 3 (map (fn x (if (< x 3) x (head ()))) (iota 10)))", "(0 1 2)", "" },
+		{"(take 4 (map sqrt (iota 1000000000)))", "(0 1 1.414213562373095 1.732050807568877)", "" },
+		{"(head (drop 2 (zipWith * (iota 1000000000) (iota 1000000000))))", "4", "" },
+		{"(head (filter (fn x (> x 4)) (map (fn x (if (< x 6) x (head ()))) (iota 10))))", "5", "" },
+		{"(tail (map (fn x (* x 2)) (iota 4)))", "(2 4 6)", "" },
+		{"(drop 2 (takeWhile (fn x (< x 5)) (iota 9)))", "(2 3 4)", "" },
+		{"(dropWhile (fn x (> x 5)) (map (fn x (- 9 x)) (iota 9)))", "(5 4 3 2 1)", "" },
+		{"(zipWith (fn a b (* a b)) (filter (fn x (% x 2)) (iota 10)) (iota 3))", "(0 3 10)", "" },
+		{"(foldl + 0 (map (fn x (* x 2)) (iota 100000)))", "9999900000", "" },
+		{"(foldl1 + (filter (fn x (> x 5)) (iota 3)))", "", "Invalid argument ()" },
+		{"(seq (def total 0) (map (fn x (def total (+ total x))) (iota 5)) total)", "10", "" },
+		{"(seq (map (fn x (head ())) (1 2)) 5)", "", "Invalid argument ()" },
+		{"(let s (map (fn x (+ x k)) (1 2)) (seq (def k 100) s))", "(1 2)", "" },
+		{"(seq (def calls 0 f (fn x (seq (def calls (+ calls 1)) x))) (take 3 (filter (fn x (> x 10)) (map f (iota 1000)))) calls)", "14", "" },
+		{"(seq (def calls 0 f (fn x (seq (def calls (+ calls 1)) x)) walk (fn s a (if (empty s) a (walk (tail s) (+ a (head s)))))) (walk (map f (iota 2000)) 0) calls)", "2000", "" },
+		{"(head (tail (drop 2 (drop 3 (map (fn x (* x 2)) (iota 10))))))", "12", "" },
+		{"(seq (def calls 0 f (fn x (seq (def calls (+ calls 1)) x)) table (map f (iota 500)) sum (fn i a (if (< i 500) (sum (+ i 1) (+ a (nth i table))) a))) (sum 0 0) calls)", "500", "" },
+		{"(length (filter (fn x (> x 2)) (iota 10)))", "7", "" },
+		{"(reverse (map (fn x (* x x)) (1 2 3)))", "(9 4 1)", "" },
+		{"(let k 10 (map (fn x (+ x k)) (iota 3)))", "(10 11 12)", "" },
+		{"(seq (def s (map (fn x (* x x)) (iota 4))) (concat s s))", "(0 1 4 9 0 1 4 9)", "" },
+		{"(empty (filter (fn x 0) (iota 5)))", "1", "" },
+		{"(= (take 3 (drop 2 (iota 10))) (2 3 4))", "1", "" },
+		{"(dict)", "(dict)", "" },
+		{"(dict a)", "", "Insufficient arguments (dict a)" },
+		{"(dict (1) 2)", "", "Invalid argument (1)" },
+		{"(dict b (1 2) a 1 c x)", "(dict a 1 b (1 2) c x)", "" },
+		{"(dict b (1 2) a 1 c (dict x 2))", "(dict a 1 b (1 2) c (dict x 2))", "" },
+		{"(= (dict a 1 b (1 2) c (dict x 2)) (dict c (dict x 2) a 1 b (1 2)))", "1", "" },
+		{"(lookup (dict a 1 b 2) b)", "2", "" },
+		{"(lookup (dict a 1) z)", "", "" },
+		{"(lookup (dict a 1) z 7)", "7", "" },
+		{"(lookup (1 2) a)", "", "Invalid argument (1 2)" },
+		{"(has (dict a 1) a)", "1", "" },
+		{"(has (dict a 1) b)", "", "" },
+		{"(keys (assoc (dict a 1) c 3 b 2))", "(a b c)", "" },
+		{"(values (assoc (dict a 1 b 2) a 5))", "(5 2)", "" },
+		{"(dissoc (dict a 1 b 2 c 3) b z)", "(dict a 1 c 3)", "" },
+		{"(let d (dict a 1) (seq (assoc d b 2) d))", "(dict a 1)", "" },
+		{"(length (dict a 1 b 2))", "2", "" },
+		{"(empty (dict))", "1", "" },
+		{"(= (dict a 1 b 2) (dict b 2 a 1))", "1", "" },
+		{"(= (dict a 1 b 2) (dict a 1 b 3))", "", "" },
+		{"(= (dict a 1) (a 1))", "", "" },
+		{"(length (foldl (fn d x (assoc d x (* x x))) (dict) (iota 10000)))", "10000", "" },
+		{"(foldl (fn d x (dissoc d x)) (foldl (fn d x (assoc d x (* x x))) (dict) (iota 1000)) (iota 997))", "(dict 997 994009 998 996004 999 998001)", "" },
+		{"(nth 2 (a b c d))", "c", "" },
+		{"(nth 0 (iota 5))", "0", "" },
+		{"(nth 4 (a b c d))", "", "Invalid argument 4" },
+		{"(nth -1 (a b))", "", "Invalid argument -1" },
+		{"(nth 1.5 (a b))", "", "Invalid argument 1.5" },
+		{"(nth 3 (filter (fn x (% x 2)) (iota 100)))", "7", "" },
+		{"(nth 99999 (map (fn x (* x 2)) (iota 100000)))", "199998", "" },
+		{"(slice 2 5 (a b c d e f))", "(c d e)", "" },
+		{"(slice 2 5 (iota 10))", "(2 3 4)", "" },
+		{"(slice 1 10 (a b c))", "(b c)", "" },
+		{"(slice 5 2 (a b c))", "()", "" },
+		{"(slice 2 4 (map (fn x (* x 2)) (iota 10)))", "(4 6)", "" },
+		{"(last (a b c))", "c", "" },
+		{"(last (iota 5))", "4", "" },
+		{"(last ())", "", "Invalid argument ()" },
+		{"(init (a b c))", "(a b)", "" },
+		{"(init (iota 3))", "(0 1)", "" },
+		{"(length (init (drop 10 (iota 100))))", "89", "" },
+		{"(init ())", "()", "" },
+		{"(sort (3 1 2))", "(1 2 3)", "" },
+		{"(sort (b a 10 2 (1 2) (1) c))", "(2 10 a b c (1) (1 2))", "" },
+		{"(sort (map (fn x (% (* x 7) 10)) (iota 10)))", "(0 1 2 3 4 5 6 7 8 9)", "" },
+		{"(sort (cons (fn x x) (1)))", "", "Invalid argument <fn>" },
+		{"(sortBy > (3 1 2))", "(3 2 1)", "" },
+		{"(sortBy (fn a b (> a b)) (3 1 2))", "(3 2 1)", "" },
+		{"(sortBy (fn x (- 0 x)) (3 1 2 5))", "(5 3 2 1)", "" },
+		{"(sortBy head ((2 a) (1 b) (2 c) (1 d)))", "((1 b) (1 d) (2 a) (2 c))", "" },
+		{"(binarySearch 5 (iota 10))", "5", "" },
+		{"(binarySearch 11 (iota 10))", "-1", "" },
+		{"(binarySearch c (a b c d))", "2", "" },
+		{"(unique (3 1 3 2 1))", "(3 1 2)", "" },
+		{"(unique (a b a (1) (1)))", "(a b (1))", "" },
+		{"(unique (map (fn x (% x 3)) (iota 10)))", "(0 1 2)", "" },
+		{"(minimum (3 1 2))", "1", "" },
+		{"(maximum (b c a))", "c", "" },
+		{"(maximum (iota 5))", "4", "" },
+		{"(minimum ())", "", "Invalid argument ()" },
+		{"(partition (fn x (> x 2)) (iota 6))", "((3 4 5) (0 1 2))", "" },
+		{"(pmap (fn x (* x x)) (iota 5))", "(0 1 4 9 16)", "" },
+		{"(pfilter (fn x (% x 2)) (iota 6))", "(1 3 5)", "" },
+		{"(preduce + (iota 5))", "10", "" },
+		{"(preduce (fn a b (concat a b)) ((1) (2) (3)))", "(1 2 3)", "" },
+		{"(preduce + ())", "", "Invalid argument ()" },
+		{"(+ 9007199254740993 2)", "9007199254740995", "" },
+		{"(- 9223372036854775807 9223372036854775806)", "1", "" },
+		{"(* 3037000499 3037000499)", "9223372030926249001", "" },
+		{"(* 4294967296 4294967296)", "18446744073709551616", "" },
+		{"(% 9007199254740993 10)", "3", "" },
+		{"(/ 9007199254740993 3)", "3002399751580331", "" },
+		{"(/ 7 2)", "3.5", "" },
+		{"(= 9007199254740993 9007199254740992)", "", "" },
+		{"(< 9007199254740992 9007199254740993)", "1", "" },
+		{"(> 9007199254740993 9007199254740992)", "1", "" },
+		{"(map (fn x (+ x 9007199254740990)) (iota 4))", "(9007199254740990 9007199254740991 9007199254740992 9007199254740993)", "" },
+		{"(foldl + 1 (val 9007199254740992 9007199254740992))", "18014398509481985", "" },
+		{"(foldl * 1 (drop 1 (iota 21)))", "2432902008176640000", "" },
+		{"(+ (length (iota 3)) 0.5)", "3.5", "" },
 		{"(takeWhile ())", "", "Insufficient arguments (takeWhile ())" },
 		{"(takeWhile () (123 456))", "", "Invalid argument ()" },
 		{"(takeWhile 666 (123 456))", "", "Invalid argument 666" },
@@ -434,6 +609,16 @@ void test_basic_functions()
 		{"(foldr + 1 (2 3))", "6",  "" },
 		{"(foldr * 2 (1 2 3 4))", "48",  "" },
 		{"(foldr / 2 (1 2 3 4))", "0.75",  "" },
+		{"(foldr - 0 (iota 4))", "-2",  "" },
+		{"(foldr1 - (iota 4))", "-2",  "" },
+		{"(foldl1 - (iota 4))", "-6",  "" },
+		{"(foldl + 0 (iota 1000000))", "499999500000",  "" },
+		{"(foldl + 0.5 (1 2 x))", "3.5",  "" },
+		{"(foldl < 0 (1 2))", "1",  "" },
+		{"(foldr (fn x a (cons x a)) () (iota 3))", "(0 1 2)",  "" },
+		{"(foldl1 (fn a x (+ (* a 10) x)) (take 4 (drop 1 (iota 9))))", "1234",  "" },
+		{"(map (fn x y (+ x y)) (1 2))", "",  "Insufficient arguments (<fn> 1)" },
+		{"(seq (def a 5) (map (fn x x) (val a b)))", "(a b)",  "" },
 	};
 
 	auto count = 0, failed = 0;
@@ -442,7 +627,7 @@ void test_basic_functions()
 	{
 		auto eli = new maxy::control::ELI::ELI();
 
-		auto result = eli->run(test_case[0]);
+		auto result = compiled ? eli->run(eli->compile(test_case[0])) : eli->run(test_case[0]);
 
 		auto failure = false;
 
@@ -479,9 +664,9 @@ void test_basic_functions()
 	std::cout << "-----------------------------\n" << count << " TESTS, " << failed << " FAILURES\n\n";
 }
 
-void test_integrations()
+void test_integrations(bool compiled)
 {
-	std::cout << "\n\nTesting integrations\n";
+	std::cout << "\n\nTesting integrations" << (compiled ? " (compiled)" : "") << "\n";
 
 	auto count = 0, failed = 0;
 
@@ -524,6 +709,9 @@ void test_integrations()
 		{"(seq (set f (-123)) (get f))", "(-123)", ""},
 		{"(seq (set d (-123)) (get d))", "(-123)", ""},
 		{"(seq (set b (-123)) (get b))", "(1)", ""},
+		{"(seq (set ll (9007199254740993)) (get ll))", "(9007199254740993)", ""},
+		{"(seq (set ll (-9223372036854775807)) (- (head (get ll)) 1))", "-9223372036854775808", ""},
+		{"(seq (set ull (18446744073709551615)) (get ull))", "(18446744073709551615)", ""},
 		{"(set fvec2 (666))", "", "Insufficient arguments (666)"},
 		{"(seq (set fvec2 (666 999)) (get fvec2))", "(666 999)", ""},
 		{"(set dvec3 (666 777))", "", "Insufficient arguments (666 777)"},
@@ -536,7 +724,15 @@ void test_integrations()
 
 		// func
 		{"(call xxx ())", "", "Function not found xxx"},
-		{"(call fun (1 2 3))", "(3 2 1 LOL)", ""}
+		{"(call fun (1 2 3))", "(3 2 1 LOL)", ""},
+
+		// async func
+		{"(callAsync xxx ())", "", "Function not found xxx"},
+		{"(callAsync later (1))", "<pending>", ""},
+		{"(await (callAsync later (1 2 3)))", "(3 2 1)", ""},
+		{"(await (callAsync fun (1 2 3)))", "(3 2 1 LOL)", ""},
+		{"(awaitAll (cons (callAsync later (1 2)) (cons (callAsync fun (4 5 6)) (7))))", "((2 1) (6 5 4 LOL) 7)", ""},
+		{"(await 5)", "5", ""}
 	};
 
 	for (auto test_case : test_cases)
@@ -555,8 +751,11 @@ void test_integrations()
 		eli->var("dvec3", &dvec3[0], 3);
 		eli->var("ivec4", &ivec4[0], 4);
 		eli->func("fun", [](std::vector<std::string> s) { return std::vector<std::string>{s[2], s[1], s[0], "LOL"}; });
+		eli->func_async("later", [](std::vector<std::string> s) {
+			return std::async(std::launch::async, [s] { return std::vector<std::string>(s.rbegin(), s.rend()); });
+		});
 
-		auto result = eli->run(test_case[0]);
+		auto result = compiled ? eli->run(eli->compile(test_case[0])) : eli->run(test_case[0]);
 
 		auto failure = false;
 
@@ -593,6 +792,578 @@ void test_integrations()
 	std::cout << "-----------------------------\n" << count << " TESTS, " << failed << " FAILURES\n\n";
 }
 
+void test_programs()
+{
+	std::cout << "\n\nTesting compiled programs\n";
+
+	auto count = 0, failed = 0;
+
+	auto eli = new maxy::control::ELI::ELI();
+
+	auto check = [&](std::pair<std::string, std::string> result, const char* expected) {
+		count++;
+		if (result.first != expected || result.second != "")
+		{
+			failed++;
+			std::cout << "FAILURE: expected \"" << expected << "\", received \"" << result.first << "\" (" << result.second << ")\n";
+		}
+	};
+
+	// a program can be run many times, globals persist between the runs
+	auto counter = eli->compile("(seq (def n (+ n 1)) n)");
+	eli->run("(def n 0)");
+	check(eli->run(counter), "1");
+	check(eli->run(counter), "2");
+	check(eli->run(counter), "3");
+
+	// functions made by a program stay usable after the program is gone
+	eli->run(eli->compile("(def sq (fn x (* x x)))"));
+	check(eli->run("(sq 12)"), "144");
+	check(eli->run(eli->compile("(map sq (iota 4))")), "(0 1 4 9)");
+
+	// deep recursion is limited as in the interpreter
+	auto sum = eli->compile("(seq (def sum (fn n (if (= n 0) 0 (+ n (sum (- n 1)))))) (sum 100000))");
+	auto summed = eli->run(sum);
+	count++;
+	if (summed.second.find("Maximum recursion depth exceeded") != 0)
+	{
+		failed++;
+		std::cout << "FAILURE: expected the recursion depth error, received \"" << summed.first << "\" (" << summed.second << ")\n";
+	}
+	check(eli->run(eli->compile("(sum 5000)")), "12502500");
+
+	// calls in tail position do not nest
+	auto loop = "(seq (def loop (fn n acc (if (= n 0) acc (loop (- n 1) (+ acc 1))))) (loop 200000 0))";
+	check(eli->run(loop), "200000");
+	check(eli->run(eli->compile(loop)), "200000");
+	check(eli->run("(seq (def countdown (fn n (let m (- n 1) (if (= m 0) m (seq (countdown m)))))) (countdown 50000))"), "0");
+
+	// head/tail recursion and cons do not copy the lists
+	auto walk = "(seq (def len (fn l n (if (empty l) n (len (tail l) (+ n 1))))) (def build (fn n acc (if (= n 0) acc (build (- n 1) (cons n acc))))) (len (build 100000 ()) 0))";
+	check(eli->run(walk), "100000");
+	check(eli->run(eli->compile(walk)), "100000");
+
+	// deeper nesting fails instead of overflowing the stack
+	eli->set_max_depth(100);
+	eli->run("(def tsum (fn n (if (= n 0) 0 (+ n (tsum (- n 1))))))");
+	check(eli->run("(tsum 50)"), "1275");
+	auto deep = eli->run("(tsum 1000)");
+	count++;
+	if (deep.second.find("Maximum recursion depth exceeded") != 0)
+	{
+		failed++;
+		std::cout << "FAILURE: expected the recursion depth error, received \"" << deep.first << "\" (" << deep.second << ")\n";
+	}
+	auto runaway = eli->run(eli->compile("(seq (def f (fn x (+ 1 (f x)))) (f 1))"));
+	count++;
+	if (runaway.second.find("Maximum recursion depth exceeded") != 0)
+	{
+		failed++;
+		std::cout << "FAILURE: expected the recursion depth error, received \"" << runaway.first << "\" (" << runaway.second << ")\n";
+	}
+	eli->set_max_depth(10000);
+
+	// shadowed builtins are respected
+	check(eli->run(eli->compile("(let + - (+ 5 3))")), "2");
+	check(eli->run(eli->compile("((fn if (if 1 2 3)) val)")), "(1 2 3)");
+
+	// lambdas passed to higher-order builtins
+	check(eli->run(eli->compile("(foldl + 0 (map (fn x (* x 2)) (filter (fn x (> x 1)) (iota 5))))")), "18");
+
+	// lambdas returned by higher-order builtins outlive the program
+	auto fold = eli->compile("(def h (foldl (fn a b a) (fn q (+ q 100)) (val 1)))");
+	eli->run(fold);
+	auto doubled = eli->compile("(def d (map (fn x (* x 2)) (iota 3)))");
+	eli->run(doubled);
+	fold.reset();
+	doubled.reset();
+	check(eli->run("(h 5)"), "105");
+	check(eli->run("d"), "(0 2 4)");
+
+	delete eli;
+
+	std::cout << "-----------------------------\n" << count << " TESTS, " << failed << " FAILURES\n\n";
+}
+
+using Cases = std::vector<std::vector<const char *>>;
+using Results = std::vector<std::pair<std::string, std::string>>;
+
+// Compare results with the {input, output, error} cases in the same order
+static void check_results(const Cases& test_cases, const Results& results, int& count, int& failed)
+{
+	for (size_t i = 0; i < test_cases.size(); i++)
+	{
+		auto& test_case = test_cases[i];
+		auto result = i < results.size() ? results[i] : std::make_pair(std::string(), std::string("no result"));
+
+		auto failure = false;
+
+		if (result.first != test_case[1])
+		{
+			failure = true;
+
+			std::cout << "FAILURE FOR \"" << test_case[0] << "\"\n"
+				<< "WRONG RESULT\n"
+				<< "\texpected \"" << test_case[1] << "\"\n"
+				<< "\treceived \"" << result.first << "\"\n";
+		}
+
+		if (result.second != test_case[2])
+		{
+			if (!failure)
+			{
+				std::cout << "FAILURE FOR \"" << test_case[0] << "\"\n";
+			}
+
+			failure = true;
+
+			std::cout << "WRONG ERROR FOR \"" << test_case[0] << "\"\n"
+				<< "\texpected \"" << test_case[2] << "\"\n"
+				<< "\treceived \"" << result.second << "\"\n";
+		}
+
+		count++;
+		if (failure) failed++;
+	}
+}
+
+// Run the cases one after another, every case sees the definitions of the ones before it
+template<typename Run>
+static void run_cases(const Cases& test_cases, Run run, int& count, int& failed)
+{
+	Results results;
+	for (auto& test_case : test_cases) results.push_back(run(test_case[0]));
+
+	check_results(test_cases, results, count, failed);
+}
+
+// interpreter redefined by another thread while a script runs (see test_scripts)
+static maxy::control::ELI::ELI* redefined;
+
+void test_scripts()
+{
+	std::cout << "\n\nTesting prepared scripts\n";
+
+	auto count = 0, failed = 0;
+
+	auto eli = new maxy::control::ELI::ELI();
+	auto run = [&](const char* text) { return eli->run(text); };
+
+	// a prepared script reads the current globals on every run
+	std::unordered_map<std::string, maxy::control::ELI::ELI::ScriptPtr> scripts;
+	auto prepared = [&](const char* text) {
+		auto& script = scripts[text];
+		if (!script) script = eli->prepare(text);
+		return eli->run(script);
+	};
+
+	run_cases({
+		{"(f 20)", "(f 20)", ""},
+		{"(def f (fn x (+ x 1)))", "", ""},
+		{"(f 20)", "21", ""},
+		{"(def f (fn x (* x 2)))", "", ""},
+		{"(f 20)", "40", ""},
+		{"(seq (def f (fn x (- x 1))) (f 20))", "19", ""},
+		{"(f 20)", "19", ""}
+	}, prepared, count, failed);
+
+	// run(text) keeps the parsed scripts in a bounded cache
+	auto before = eli->cache_stats();
+	run_cases({
+		{"(+ 1 2)", "3", ""},
+		{"(+ 1 2)", "3", ""},
+		{"(+ 1 2)", "3", ""}
+	}, run, count, failed);
+	auto after = eli->cache_stats();
+
+	eli->set_cache_capacity(2);
+	run_cases({
+		{"(+ 1 3)", "4", ""},
+		{"(+ 1 4)", "5", ""},
+		{"(+ 1 5)", "6", ""}
+	}, run, count, failed);
+	auto bounded = eli->cache_stats();
+
+	eli->set_cache_capacity(0);
+	run_cases({
+		{"(+ 1 6)", "7", ""}
+	}, run, count, failed);
+	auto disabled = eli->cache_stats();
+
+	check_results({
+		{"cache misses", "1", ""},
+		{"cache hits", "2", ""},
+		{"size of a bounded cache", "2", ""},
+		{"size of a disabled cache", "0", ""}
+	}, {
+		{ std::to_string(after.misses - before.misses), "" },
+		{ std::to_string(after.hits - before.hits), "" },
+		{ std::to_string(bounded.size), "" },
+		{ std::to_string(disabled.size), "" }
+	}, count, failed);
+
+	// a run reads the globals as they were when it started, with its own definitions
+	redefined = eli;
+	eli->func("redefine", [](std::vector<std::string>) {
+		std::thread([] { redefined->run("(def seen 2)"); }).join();
+		return std::vector<std::string>{};
+	});
+
+	run_cases({
+		{"(def seen 1)", "", ""},
+		{"(seq (call redefine ()) (def own 3) (+ seen own))", "4", ""},
+		{"(+ seen own)", "5", ""}
+	}, run, count, failed);
+
+	// values made by a finished thread stay valid
+	std::thread([&] () {
+		eli->run("(def doubled (map (fn x (* x 2)) (iota 1000)))");
+	}).join();
+
+	run_cases({
+		{"(length doubled)", "1000", ""},
+		{"(nth 999 doubled)", "1998", ""}
+	}, run, count, failed);
+
+	delete eli;
+
+	// nodes may come from the global heap instead of the pools
+	eli = new maxy::control::ELI::ELI();
+	eli->set_allocator(maxy::control::ELI::ELI::heap_allocator);
+
+	run_cases({
+		{"(foldl + 0 (map (fn x (* x 2)) (iota 10)))", "90", ""}
+	}, run, count, failed);
+
+	delete eli;
+
+	std::cout << "-----------------------------\n" << count << " TESTS, " << failed << " FAILURES\n\n";
+}
+
+// keeps the external function `hold` busy (see test_parallel)
+static std::atomic<bool> held;
+
+void test_parallel()
+{
+	std::cout << "\n\nTesting the thread pool\n";
+
+	auto count = 0, failed = 0;
+
+	auto eli = new maxy::control::ELI::ELI();
+	auto run = [&](const char* text) { return eli->run(text); };
+
+	eli->func("explode", [](std::vector<std::string> s) {
+		if (s[0] == "3") throw std::runtime_error("exploded");
+		return s;
+	});
+	eli->func("swap", [](std::vector<std::string> s) { return std::vector<std::string>{ s[1], s[0] }; });
+	eli->func("hold", [](std::vector<std::string> s) {
+		while (held) std::this_thread::yield();
+		return s;
+	});
+
+	run_cases({
+		{"(def k 3 xs (map (fn x x) (iota 2000)) shuffled (map (fn x (% (* x 7919) 10007)) (iota 20000)))", "", ""},
+		{"(seq (def sorted (sort shuffled)) (length sorted))", "20000", ""}
+	}, run, count, failed);
+
+	eli->set_thread_pool(4);
+	eli->set_parallel_threshold(10);
+	eli->set_parallel_sort_threshold(1000);
+
+	held = true;
+
+	run_cases({
+		// long lists are sorted on the pool
+		{"(= (sort shuffled) sorted)", "1", ""},
+		{"(= (sortBy (fn x x) shuffled) sorted)", "1", ""},
+		{"(= (sort (sortBy > (iota 20000))) (iota 20000))", "1", ""},
+
+		// pmap, pfilter and preduce split the list between the threads of the pool
+		{"(foldl + 0 (pmap (fn x (* x k)) xs))", "5997000", ""},
+		{"(nth 1999 (pmap (fn x (* x k)) xs))", "5997", ""},
+		{"(let y 1000 (length (pfilter (fn x (< x y)) xs)))", "1000", ""},
+		{"(preduce (fn a b (+ a b)) xs)", "1999000", ""},
+		{"(pmap (fn x (head x)) xs)", "", "Invalid argument 0"},
+		{"(length (pmap (fn x (length (pmap (fn y y) xs))) (take 20 xs)))", "20", ""},
+
+		// an exception of an external function fails the call that reached it
+		{"(pmap (fn x (call explode (x))) xs)", "", "Exception exploded"},
+		{"(length (pmap (fn x (call explode (x))) (drop 4 xs)))", "1996", ""},
+
+		// external calls started by callAsync run on the pool
+		{"(awaitAll (map (fn k (callAsync swap (k 0))) (1 2 3)))", "((0 1) (0 2) (0 3))", ""},
+		{"(await (callAsync explode (3)))", "", "Exception exploded"},
+		{"(length (pmap (fn x (await (callAsync swap (x x)))) xs))", "2000", ""},
+
+		// a result that is never awaited is dropped without waiting for the call
+		{"(seq (callAsync hold ()) 1)", "1", ""}
+	}, run, count, failed);
+
+	check_results({
+		{"type of a pending result", "1", ""}
+	}, {
+		{ std::to_string(eli->new_pending(std::promise<std::vector<std::string>>().get_future().share())->type() == maxy::control::ELI::ELI::Node::Type::Pending), "" }
+	}, count, failed);
+
+	held = false;
+	delete eli;
+
+	std::cout << "-----------------------------\n" << count << " TESTS, " << failed << " FAILURES\n\n";
+}
+
+void test_batches()
+{
+	std::cout << "\n\nTesting batches\n";
+
+	auto count = 0, failed = 0;
+
+	auto eli = new maxy::control::ELI::ELI();
+	eli->set_thread_pool(4);
+	eli->run("(def k 3)");
+	eli->func("explode", [](std::vector<std::string> s) {
+		if (s[0] == "3") throw std::runtime_error("exploded");
+		return s;
+	});
+
+	// a batch runs one script for many inputs, the results come back in order
+	std::vector<maxy::control::ELI::ELI::Bindings> records;
+	for (int i = 0; i < 100; i++)
+		records.push_back({ { "id", eli->new_atom((long long)i) }, { "values", eli->new_list({ "1", "2", std::to_string(i) }) } });
+	records[7] = { { "id", eli->new_atom("seven") } };
+
+	auto batch = eli->run_batch("(seq (def seen id) (* k (+ id (foldl + 0 values))))", records);
+
+	check_results({
+		{"id 0", "9", ""},
+		{"id 6", "45", ""},
+		{"id seven", "", "Invalid argument values"},
+		{"id 8", "57", ""},
+		{"id 99", "603", ""}
+	}, { batch[0], batch[6], batch[7], batch[8], batch[99] }, count, failed);
+
+	// a batch of prepared scripts
+	Cases scripts = {
+		{"(+ 1 2)", "3", ""},
+		{"(head ())", "", "Invalid argument ()"},
+		{"(* k 2)", "6", ""}
+	};
+	std::vector<maxy::control::ELI::ELI::ScriptPtr> prepared;
+	for (auto& script : scripts) prepared.push_back(eli->prepare(script[0]));
+	check_results(scripts, eli->run_batch(prepared), count, failed);
+
+	// an exception of an external function fails only its own item
+	std::vector<maxy::control::ELI::ELI::Bindings> fuses;
+	for (int i = 0; i < 5; i++) fuses.push_back({ { "x", eli->new_atom((long long)i) } });
+
+	check_results({
+		{"x 0", "(0)", ""},
+		{"x 1", "(1)", ""},
+		{"x 2", "(2)", ""},
+		{"x 3", "", "Exception exploded"},
+		{"x 4", "(4)", ""}
+	}, eli->run_batch("(call explode (x))", fuses), count, failed);
+
+	delete eli;
+
+	// without a pool a batch runs on the calling thread, every item with the globals the batch started with
+	eli = new maxy::control::ELI::ELI();
+	eli->run("(def total 0)");
+
+	check_results({
+		{"x 1", "1", ""},
+		{"x 2", "2", ""},
+		{"x 3", "3", ""}
+	}, eli->run_batch("(seq (def total (+ total x)) total)", { { { "x", eli->new_atom(1ll) } }, { { "x", eli->new_atom(2ll) } }, { { "x", eli->new_atom(3ll) } } }), count, failed);
+
+	// the bindings are local, the definitions of the last item are kept
+	run_cases({
+		{"x", "x", ""},
+		{"total", "3", ""}
+	}, [&](const char* text) { return eli->run(text); }, count, failed);
+
+	delete eli;
+
+	std::cout << "-----------------------------\n" << count << " TESTS, " << failed << " FAILURES\n\n";
+}
+
+void test_contexts()
+{
+	std::cout << "\n\nTesting contexts\n";
+
+	auto count = 0, failed = 0;
+
+	auto eli = new maxy::control::ELI::ELI();
+	auto run = [&](const char* text) { return eli->run(text); };
+	eli->run("(def square (fn x (* x x)) base 10)");
+
+	{
+		// contexts share the image and keep their definitions to themselves until they merge them
+		maxy::control::ELI::ELI::Context first(*eli), second(*eli);
+		auto in_first = [&](const char* text) { return first.run(text); };
+		auto in_second = [&](const char* text) { return second.run(text); };
+
+		run_cases({
+			{"(seq (def base 1 total (square 3)) (+ base total))", "10", ""}
+		}, in_first, count, failed);
+		run_cases({
+			{"base", "10", ""}
+		}, in_second, count, failed);
+		run_cases({
+			{"total", "total", ""}
+		}, run, count, failed);
+
+		auto merged = first.merge({ "total", "square", "unknown" });
+
+		run_cases({
+			{"(+ base total)", "19", ""}
+		}, run, count, failed);
+		run_cases({
+			{"total", "total", ""}
+		}, in_second, count, failed);
+
+		// a refreshed context reads the current globals and keeps its own definitions
+		second.refresh();
+		eli->run("(def base 20)");
+		first.refresh();
+
+		run_cases({
+			{"total", "9", ""},
+			{"base", "10", ""}
+		}, in_second, count, failed);
+
+		first.set_allocator(maxy::control::ELI::ELI::heap_allocator);
+		run_cases({
+			{"base", "1", ""},
+			{"(foldl + 0 (map (fn x (* x base)) (iota 10)))", "45", ""},
+			{"(head ())", "", "Invalid argument ()"}
+		}, in_first, count, failed);
+
+		// the registries and settings of the image stay as they are while contexts use it
+		auto frozen = false;
+		try
+		{
+			eli->func("late", [](std::vector<std::string> s) { return s; });
+		}
+		catch (const std::logic_error&)
+		{
+			frozen = true;
+		}
+
+		run_cases({
+			{"(call late (1))", "", "Function not found late"}
+		}, in_first, count, failed);
+
+		auto stats = first.stats();
+		check_results({
+			{"merged definitions", "1", ""},
+			{"runs of a context", "5", ""},
+			{"failed runs of a context", "2", ""},
+			{"definitions of a context", "2", ""},
+			{"func while contexts exist", "1", ""}
+		}, {
+			{ std::to_string(merged), "" },
+			{ std::to_string(stats.runs), "" },
+			{ std::to_string(stats.failures), "" },
+			{ std::to_string(stats.definitions), "" },
+			{ std::to_string(frozen), "" }
+		}, count, failed);
+
+		// one context per thread, running a text that this thread has run already
+		run_cases({
+			{"(+ mine (square base))", "100", ""}
+		}, in_second, count, failed);
+
+		Results sums(4);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++)
+			threads.emplace_back([&, t] {
+				maxy::control::ELI::ELI::Context context(*eli);
+				context.run(("(def mine " + std::to_string(t) + ")").c_str());
+				for (int i = 0; i < 100; i++) sums[t] = context.run("(+ mine (square base))");
+			});
+		for (auto& t : threads) t.join();
+
+		check_results({
+			{"mine 0", "400", ""},
+			{"mine 1", "401", ""},
+			{"mine 2", "402", ""},
+			{"mine 3", "403", ""}
+		}, sums, count, failed);
+
+		run_cases({
+			{"mine", "mine", ""}
+		}, run, count, failed);
+
+		// one parsed script run by all the threads at once, each reading its own globals
+		auto script = eli->prepare("(seq (def calls (+ calls 1)) (+ (* mine 1000) (square calls)))");
+		Results last(4);
+		threads.clear();
+		for (int t = 0; t < 4; t++)
+			threads.emplace_back([&, t] {
+				maxy::control::ELI::ELI::Context context(*eli);
+				context.run(("(def calls 0 mine " + std::to_string(t) + ")").c_str());
+				for (int i = 0; i < 100; i++) last[t] = context.run(script);
+			});
+		for (auto& t : threads) t.join();
+
+		check_results({
+			{"mine 0", "10000", ""},
+			{"mine 1", "11000", ""},
+			{"mine 2", "12000", ""},
+			{"mine 3", "13000", ""}
+		}, last, count, failed);
+	}
+
+	// the image can change once the contexts are gone
+	eli->func("late", [](std::vector<std::string> s) { return s; });
+	run_cases({
+		{"(call late (1))", "(1)", ""}
+	}, run, count, failed);
+
+	delete eli;
+
+	std::cout << "-----------------------------\n" << count << " TESTS, " << failed << " FAILURES\n\n";
+}
+
+void test_symbols()
+{
+	std::cout << "\n\nTesting the symbol table\n";
+
+	auto count = 0, failed = 0;
+
+	// only the names bound by def, let and fn take places in the symbol table
+	auto eli = new maxy::control::ELI::ELI();
+	eli->set_cache_capacity(0);
+
+	std::string words = "(seq (val";
+	for (auto i = 0; i < 1100000; i++) words += " word" + std::to_string(i);
+	words += ") (def brandnew 1) brandnew)";
+
+	run_cases({
+		{words.c_str(), "1", ""}
+	}, [&](const char* text) { return eli->run(text); }, count, failed);
+
+	delete eli;
+
+	// a name that does not fit into a full symbol table cannot be defined
+	eli = new maxy::control::ELI::ELI();
+	for (auto i = 0; eli->intern("name" + std::to_string(i)) != maxy::control::ELI::ELI::no_symbol; i++) {}
+
+	run_cases({
+		{"(seq (def brandnew 1) brandnew)", "", "Symbol table is full brandnew"},
+		{"(seq (def name7 7) name7)", "7", ""}
+	}, [&](const char* text) { return eli->run(text); }, count, failed);
+
+	run_cases({
+		{"(def brandnew 1)", "", "Symbol table is full brandnew"}
+	}, [&](const char* text) { return eli->run(eli->compile(text)); }, count, failed);
+
+	delete eli;
+
+	std::cout << "-----------------------------\n" << count << " TESTS, " << failed << " FAILURES\n\n";
+}
+
 void test_threading()
 {
 	std::cout << "\n\nTesting multithreading\n";
@@ -636,9 +1407,25 @@ int main()
 {
 	test_classes();
 
-	test_basic_functions();
+	test_basic_functions(false);
+
+	test_basic_functions(true);
+
+	test_integrations(false);
+
+	test_integrations(true);
+
+	test_programs();
+
+	test_scripts();
+
+	test_parallel();
+
+	test_batches();
+
+	test_contexts();
 
-	test_integrations();
+	test_symbols();
 
 	test_threading();
 